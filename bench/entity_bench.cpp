@@ -0,0 +1,109 @@
+// Compares koura::entity against the std::any based entity it replaced.
+// Build with optimisations, e.g. -DCMAKE_BUILD_TYPE=Release.
+
+#include <any>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include "koura.hpp"
+
+namespace {
+    // The std::any based entity, as it was before koura::entity switched to std::variant.
+    class any_entity {
+    public:
+        enum class type {
+            text, number, object, sequence
+        };
+
+        using object_t = std::unordered_map<std::string, any_entity>;
+
+        any_entity () = default;
+        any_entity (koura::text_t value) : m_type{type::text}, m_value{std::move(value)} {}
+        any_entity (koura::number_t value) : m_type{type::number}, m_value{std::move(value)} {}
+        any_entity (object_t value) : m_type{type::object}, m_value{std::move(value)} {}
+
+        auto get_type() const -> type { return m_type; }
+
+        template <class T>
+        auto get_value() -> T& { return std::any_cast<T&>(m_value); }
+
+    private:
+        type m_type;
+        std::any m_value;
+    };
+
+    template <class T>
+    void do_not_optimise (T&& value) {
+        asm volatile("" : : "g"(&value) : "memory");
+    }
+
+    template <class F>
+    void bench (const char* name, std::size_t iterations, F&& f) {
+        auto start = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < iterations; ++i) {
+            f();
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        auto ns = std::chrono::duration<double, std::nano>{elapsed}.count() / iterations;
+        std::printf("%-32s %10.2f ns/op\n", name, ns);
+    }
+
+    template <class Entity, class Object>
+    void run (const char* label) {
+        constexpr std::size_t iterations = 1'000'000;
+        std::printf("%s\n", label);
+
+        bench("  construct number", iterations, [] {
+            Entity ent {koura::number_t{42}};
+            do_not_optimise(ent);
+        });
+
+        bench("  construct short text", iterations, [] {
+            Entity ent {koura::text_t{"world"}};
+            do_not_optimise(ent);
+        });
+
+        bench("  construct long text", iterations, [] {
+            Entity ent {koura::text_t{"a string which is too long for small buffers"}};
+            do_not_optimise(ent);
+        });
+
+        Object obj;
+        obj["name"] = koura::text_t{"world"};
+        obj["num"] = koura::number_t{42};
+
+        Entity text {koura::text_t{"world"}};
+        Entity object {obj};
+
+        bench("  copy short text", iterations, [&] {
+            auto copy = text;
+            do_not_optimise(copy);
+        });
+
+        bench("  copy object", iterations, [&] {
+            auto copy = object;
+            do_not_optimise(copy);
+        });
+
+        Entity number {koura::number_t{42}};
+        koura::number_t sum = 0;
+        bench("  access number", iterations * 10, [&] {
+            do_not_optimise(number);
+            sum += number.template get_value<koura::number_t>();
+        });
+
+        typename Object::key_type key {"name"};
+        bench("  access nested text", iterations * 10, [&] {
+            do_not_optimise(object);
+            auto& name = object.template get_value<Object>().at(key);
+            sum += name.template get_value<koura::text_t>().size();
+        });
+
+        do_not_optimise(sum);
+    }
+}
+
+int main() {
+    run<any_entity, any_entity::object_t>("std::any entity");
+    run<koura::entity, koura::object_t>("koura::entity");
+}
@@ -0,0 +1,62 @@
+// Compares the vectorised built-in text filters against their scalar loops.
+// Build with optimisations, e.g. -DCMAKE_BUILD_TYPE=Release.
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include "koura.hpp"
+
+namespace {
+    using koura::detail::simd::level;
+    using filter_fn = void(*)(std::string_view, std::pmr::string&, level);
+
+    auto make_text (std::size_t size) -> std::string {
+        //Mostly plain prose, with the occasional character which needs escaping
+        const std::string sentence = "The quick brown fox jumps over the lazy dog & its friends, \"quietly\". ";
+        std::string text;
+        while (text.size() < size) {
+            text += sentence;
+        }
+        text.resize(size);
+        return text;
+    }
+
+    void bench (const char* name, filter_fn filter, std::string_view text, level lvl) {
+        constexpr std::size_t iterations = 2000;
+        std::pmr::string out;
+        out.reserve(text.size() * 2);
+
+        auto start = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < iterations; ++i) {
+            out.clear();
+            filter(text, out, lvl);
+            asm volatile("" : : "g"(out.data()) : "memory");
+        }
+        auto seconds = std::chrono::duration<double>{std::chrono::steady_clock::now() - start}.count();
+
+        const char* level_names[] = {"scalar", "sse2", "avx2"};
+        std::printf("%-12s %-8s %10.1f MB/s\n", name, level_names[static_cast<int>(lvl)],
+                    iterations * text.size() / seconds / 1e6);
+    }
+}
+
+int main() {
+    auto text = make_text(64 * 1024);
+
+    struct { const char* name; filter_fn filter; } filters[] = {
+        {"upper", koura::detail::simd::upper},
+        {"lower", koura::detail::simd::lower},
+        {"escape_html", koura::detail::simd::escape_html},
+        {"escape_url", koura::detail::simd::escape_url},
+        {"escape_json", koura::detail::simd::escape_json},
+    };
+
+    auto best = koura::detail::simd::best_level();
+    for (auto&& [name, filter] : filters) {
+        for (auto lvl : {level::scalar, level::sse2, level::avx2}) {
+            if (lvl <= best) {
+                bench(name, filter, text, lvl);
+            }
+        }
+    }
+}
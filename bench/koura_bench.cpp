@@ -0,0 +1,188 @@
+// Measures rendering of the fixture templates in bench/fixtures.
+// Build with optimisations, e.g. -DCMAKE_BUILD_TYPE=Release, and run from anywhere:
+// the fixture directory can also be given as the first argument.
+//
+// For each fixture this reports the time per render, the rate at which text is produced
+// and the number of heap allocations made per render.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <string>
+#include "koura.hpp"
+
+#ifndef KOURA_BENCH_FIXTURES
+#define KOURA_BENCH_FIXTURES "bench/fixtures"
+#endif
+
+namespace {
+    std::atomic<std::size_t> allocations {0};
+}
+
+//Every allocation goes through these, so they can be counted
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new (std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (auto p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc{};
+}
+
+void operator delete (void* p) noexcept { std::free(p); }
+void operator delete (void* p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+    auto text (const std::string& value) -> koura::entity { return koura::text_t{value}; }
+
+    auto literal_context() -> koura::context {
+        koura::context ctx{};
+        ctx.add_entity("title", "Quarterly report");
+        ctx.add_entity("user", "alice");
+        ctx.add_entity("footer", "Generated by Koura");
+        return ctx;
+    }
+
+    auto deep_context() -> koura::context {
+        auto object = [](std::initializer_list<std::pair<const char*, koura::entity>> fields) {
+            koura::object_t obj;
+            for (auto&& [name, value] : fields) {
+                obj[name] = value;
+            }
+            return koura::entity{std::move(obj)};
+        };
+
+        koura::context ctx{};
+        ctx.add_entity("site", object({
+            {"config", object({
+                {"theme", object({
+                    {"colors", object({{"primary", text("#336699")}, {"secondary", text("#993366")}})},
+                    {"fonts", object({{"body", text("Georgia")}, {"heading", text("Helvetica")}})}})}})},
+            {"owner", object({
+                {"name", text("Koura Ltd")},
+                {"contact", object({
+                    {"email", text("hello@example.com")},
+                    {"address", object({{"city", text("Edinburgh")}, {"country", text("Scotland")}})}})}})},
+            {"stats", object({{"visits", object({{"today", koura::number_t{1234}}, {"total", koura::number_t{987654}}})}})}
+        }).get_value<koura::object_t>());
+        return ctx;
+    }
+
+    auto loop_context() -> koura::context {
+        koura::sequence_t rows;
+        for (int i = 0; i < 10'000; ++i) {
+            koura::object_t row;
+            row["id"] = koura::number_t{i};
+            row["name"] = text("Customer " + std::to_string(i));
+            row["email"] = text("customer" + std::to_string(i) + "@example.com");
+            row["status"] = text(i % 3 ? "active" : "lapsed");
+            rows.emplace_back(std::move(row));
+        }
+
+        koura::context ctx{};
+        ctx.add_entity("rows", std::move(rows));
+        return ctx;
+    }
+
+    auto branch_context() -> koura::context {
+        koura::sequence_t items;
+        for (int i = 0; i < 2'000; ++i) {
+            koura::object_t item;
+            item["name"] = text("Item " + std::to_string(i));
+            item["featured"] = koura::boolean_t{i % 2 == 0};
+            item["sale"] = koura::boolean_t{i % 3 == 0};
+            item["new"] = koura::boolean_t{i % 5 == 0};
+            item["hidden"] = koura::boolean_t{i % 7 == 0};
+            items.emplace_back(std::move(item));
+        }
+
+        koura::context ctx{};
+        ctx.add_entity("items", std::move(items));
+        return ctx;
+    }
+
+    auto filter_context() -> koura::context {
+        koura::sequence_t entries;
+        for (int i = 0; i < 1'000; ++i) {
+            koura::object_t entry;
+            entry["title"] = text("   the <b>" + std::to_string(i) + "</b> THING   ");
+            entry["query"] = text("cats & dogs " + std::to_string(i));
+            entry["body"] = text("Line one\nLine \"two\"\t" + std::to_string(i));
+            entries.emplace_back(std::move(entry));
+        }
+
+        koura::context ctx{};
+        ctx.add_entity("entries", std::move(entries));
+        return ctx;
+    }
+
+    auto small_context() -> koura::context {
+        koura::object_t user;
+        user["name"] = text("alice");
+        user["unread"] = koura::number_t{3};
+
+        koura::context ctx{};
+        ctx.add_entity("user", std::move(user));
+        return ctx;
+    }
+
+    struct fixture {
+        const char* name;
+        const char* file;
+        std::function<koura::context()> make_context;
+        std::size_t iterations;
+    };
+
+    void bench (const koura::engine& engine, const std::string& dir, const fixture& fix) {
+        auto tmpl = engine.compile_file(dir + "/" + fix.file);
+        auto ctx = fix.make_context();
+
+        //Renders go through the public sink, which collects the text as a server sending it would
+        std::string out;
+        koura::output_sink sink {[&out](std::string_view chunk) { out.append(chunk); }};
+
+        //One render to size the output buffer, so the timed renders only measure the engine
+        engine.render(tmpl, sink, ctx);
+        auto bytes = out.size();
+
+        auto allocated_before = allocations.load(std::memory_order_relaxed);
+        auto start = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < fix.iterations; ++i) {
+            out.clear();
+            engine.render(tmpl, sink, ctx);
+        }
+        auto seconds = std::chrono::duration<double>{std::chrono::steady_clock::now() - start}.count();
+        auto allocated = allocations.load(std::memory_order_relaxed) - allocated_before;
+
+        std::printf("%-16s %12.0f %12.1f %14.2f %10zu\n", fix.name,
+                    seconds / fix.iterations * 1e9,
+                    static_cast<double>(bytes) * fix.iterations / seconds / 1e6,
+                    static_cast<double>(allocated) / fix.iterations,
+                    bytes);
+    }
+}
+
+int main (int argc, char** argv) {
+    std::string dir = argc > 1 ? argv[1] : KOURA_BENCH_FIXTURES;
+
+    const fixture fixtures[] = {
+        {"literal_page", "literal_page.html", literal_context, 20'000},
+        {"deep_access", "deep_access.html", deep_context, 5'000},
+        {"big_loop", "big_loop.html", loop_context, 50},
+        {"nested_if", "nested_if.html", branch_context, 500},
+        {"filter_chain", "filter_chain.html", filter_context, 200},
+        {"small", "small.html", small_context, 1'000'000},
+    };
+
+    koura::engine engine{};
+    std::printf("%-16s %12s %12s %14s %10s\n", "fixture", "ns/render", "MB/s", "allocs/render", "bytes");
+    for (auto&& fix : fixtures) {
+        bench(engine, dir, fix);
+    }
+}
@@ -0,0 +1,77 @@
+// Measures how rendering a shared compiled template scales across threads.
+// Build with optimisations, e.g. -DCMAKE_BUILD_TYPE=Release.
+
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "koura.hpp"
+
+namespace {
+    const char* page =
+        "<html><head><title>{{title}}</title></head><body>\n"
+        "<table>\n"
+        "{% for row in rows %}<tr><td>{{row.name|capitalise}}</td><td>{{row.id}}</td></tr>\n{% endfor %}"
+        "</table>\n"
+        "</body></html>\n";
+
+    auto make_context() -> koura::context {
+        koura::context ctx{};
+        ctx.add_entity("title", "Report");
+
+        koura::sequence_t rows;
+        for (int i = 0; i < 50; ++i) {
+            koura::object_t row;
+            row["name"] = koura::text_t{"row " + std::to_string(i)};
+            row["id"] = koura::number_t{i};
+            rows.emplace_back(std::move(row));
+        }
+        ctx.add_entity("rows", std::move(rows));
+        return ctx;
+    }
+
+    auto run (koura::template_cache& cache, unsigned n_threads, std::size_t renders_per_thread) -> double {
+        std::vector<std::thread> threads;
+        auto start = std::chrono::steady_clock::now();
+
+        for (unsigned i = 0; i < n_threads; ++i) {
+            threads.emplace_back([&cache, renders_per_thread] {
+                auto ctx = make_context();
+                std::string out;
+                for (std::size_t n = 0; n < renders_per_thread; ++n) {
+                    std::ostringstream ss {std::move(out)};
+                    cache.render("page", ss, ctx);
+                    out = std::move(ss).str();
+                }
+            });
+        }
+
+        for (auto&& thread : threads) {
+            thread.join();
+        }
+
+        auto elapsed = std::chrono::duration<double>{std::chrono::steady_clock::now() - start}.count();
+        return n_threads * renders_per_thread / elapsed;
+    }
+}
+
+int main() {
+    koura::engine engine{};
+    koura::template_cache cache{engine};
+    cache.add("page", page);
+
+    constexpr std::size_t renders_per_thread = 20'000;
+    auto max_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    double base = 0;
+    std::printf("%8s %16s %10s\n", "threads", "renders/s", "speedup");
+    for (unsigned n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        auto rate = run(cache, n_threads, renders_per_thread);
+        if (n_threads == 1) {
+            base = rate;
+        }
+        std::printf("%8u %16.0f %9.2fx\n", n_threads, rate, rate / base);
+    }
+}
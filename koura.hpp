@@ -8,598 +8,5049 @@
 #include <cassert>
 #include <utility>
 #include <unordered_map>
+#include <unordered_set>
 #include <string_view>
 #include <any>
+#include <type_traits>
+#include <variant>
 #include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <shared_mutex>
+#include <atomic>
+#include <charconv>
+#include <limits>
+#include <memory_resource>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <chrono>
+#include <system_error>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <exception>
+#include <string>
+#include <vector>
+
+#if __has_include(<sys/mman.h>)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define KOURA_HAS_MMAP 1
+#else
+#define KOURA_HAS_MMAP 0
+#endif
+
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define KOURA_HAS_X86_SIMD 1
+#define KOURA_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define KOURA_HAS_X86_SIMD 0
+#endif
+
+//Define this to 1 before including Koura to build in `koura::profiler` and the engine's profiling hooks
+#ifndef KOURA_PROFILING
+#define KOURA_PROFILING 0
+#endif
 
 namespace koura {
+    namespace detail {
+        /// The process-wide table of interned identifiers.
+        /// It never shrinks, so only names which come from templates or code should be interned.
+        class symbol_table {
+        public:
+            static auto instance() -> symbol_table& {
+                static symbol_table table;
+                return table;
+            }
+
+            auto intern (std::string_view name) -> std::uint32_t {
+                {
+                    std::shared_lock lock {m_mutex};
+                    auto it = m_ids.find(name);
+                    if (it != m_ids.end()) {
+                        return it->second;
+                    }
+                }
+
+                std::unique_lock lock {m_mutex};
+                auto it = m_ids.find(name);
+                if (it != m_ids.end()) {
+                    return it->second;
+                }
+
+                auto id = static_cast<std::uint32_t>(m_names.size());
+                auto& stored = m_names.emplace_back(name);
+                m_ids.emplace(stored, id);
+                return id;
+            }
+
+            /// Find the ID of `name` without interning it, or nothing if it hasn't been interned.
+            auto find (std::string_view name) -> std::optional<std::uint32_t> {
+                std::shared_lock lock {m_mutex};
+                auto it = m_ids.find(name);
+                if (it == m_ids.end()) {
+                    return std::nullopt;
+                }
+                return it->second;
+            }
+
+            auto name (std::uint32_t id) -> std::string_view {
+                std::shared_lock lock {m_mutex};
+                return m_names[id];
+            }
+
+        private:
+            symbol_table() {
+                intern("");
+            }
+
+            std::shared_mutex m_mutex;
+            std::deque<std::string> m_names;
+            std::unordered_map<std::string_view, std::uint32_t> m_ids;
+        };
+    }
+
+    /// An interned identifier.
+    ///
+    /// Equal names always intern to the same symbol, so symbols compare and hash as small integers.
+    /// Templates resolve their identifiers to symbols when they're compiled, so rendering never hashes names.
+    ///
+    /// Interned names are kept for the life of the process, so making symbols from names which aren't
+    /// bounded, such as object keys taken from user input, grows the table without limit.
+    /// Use `symbol::find` or the `context` lookups which take text to look up such names instead.
+    class symbol {
+    public:
+        symbol() = default;
+        symbol (std::string_view name) : m_id{detail::symbol_table::instance().intern(name)} {}
+        symbol (const std::string& name) : symbol{std::string_view{name}} {}
+        symbol (const char* name) : symbol{std::string_view{name}} {}
+
+        /// Get the symbol for `name` without interning it, or nothing if it has never been interned.
+        /// Nothing can be stored under a name which hasn't been interned, so lookups can stop there.
+        static auto find (std::string_view name) -> std::optional<symbol> {
+            auto id = detail::symbol_table::instance().find(name);
+            if (!id) {
+                return std::nullopt;
+            }
+            symbol sym;
+            sym.m_id = *id;
+            return sym;
+        }
 
+        /// Get the integer ID of this symbol.
+        auto id() const -> std::uint32_t { return m_id; }
+
+        /// Get the name which this symbol was interned from.
+        auto name() const -> std::string_view { return detail::symbol_table::instance().name(m_id); }
+
+        friend bool operator== (symbol lhs, symbol rhs) { return lhs.m_id == rhs.m_id; }
+        friend bool operator!= (symbol lhs, symbol rhs) { return lhs.m_id != rhs.m_id; }
+
+    private:
+        std::uint32_t m_id = 0;
+    };
+}
+
+template <>
+struct std::hash<koura::symbol> {
+    auto operator() (koura::symbol sym) const noexcept -> std::size_t { return sym.id(); }
+};
+
+namespace koura {
     class entity;
 
-    using number_t = int;
+    namespace detail {
+        struct value_binding;
+
+        /// A reference to a value in user memory, along with how to read it.
+        struct bound_ref {
+            const void* object;
+            const value_binding* binding;
+        };
+    }
+
+    using number_t = std::int64_t;
+    using real_t = double;
+    using boolean_t = bool;
     using text_t = std::string;
-    using object_t = std::unordered_map<std::string, entity>;
+    using object_t = std::unordered_map<symbol, entity>;
     using sequence_t = std::vector<entity>;
 
+    /// The value given to a formatting filter. Whole and real numbers come straight from the variable,
+    /// so they keep their full precision, and text comes from text entities or from the filter before.
+    using format_value = std::variant<std::string_view, number_t, real_t>;
+
     /// An error which occured during rendering
     class render_error : public std::runtime_error {
     public:
-        render_error(std::istream& in) :
+        render_error() :
             std::runtime_error{"Render error occurred"}
         {}
+
+        render_error(std::istream&) :
+            render_error{}
+        {}
+    };
+
+    /// A sequence whose elements are produced one at a time, as a template iterates over it.
+    ///
+    /// Rendering a `for` loop over a generator pulls one element per iteration, so huge sequences
+    /// never need to be held in memory. Copies of a generator share their position, and a generator
+    /// can only be iterated once.
+    class generator {
+    public:
+        /// Create a generator which calls `next` for each element.
+        /// `next` should store the element in its argument and return `true`, or return `false` when there are no more.
+        explicit generator (std::function<bool(entity&)> next) :
+            m_next{std::make_shared<std::function<bool(entity&)>>(std::move(next))}
+        {}
+
+        /// Create a generator which produces the elements of the range [`first`, `last`).
+        /// \requires the range is valid until the generator has been iterated.
+        template <class InputIt>
+        generator (InputIt first, InputIt last) :
+            generator{std::function<bool(entity&)>{[first, last](auto& out) mutable {
+                if (first == last) {
+                    return false;
+                }
+                out = *first;
+                ++first;
+                return true;
+            }}}
+        {}
+
+        /// Store the next element in `out`, returning `false` if there are no more.
+        bool next (entity& out) const { return (*m_next)(out); }
+
+    private:
+        std::shared_ptr<std::function<bool(entity&)>> m_next;
+    };
+
+    /// An entity whose value becomes available later, such as the result of a query to a slow backend.
+    ///
+    /// Synchronous renders wait for the value when a template first needs it, while `engine::render_async`
+    /// suspends instead. Copies of a deferred entity share the same value.
+    class deferred {
+    public:
+        /// Create a deferred entity which takes its value from the future `value`.
+        /// \requires `Future` is `std::future<entity>` or `std::shared_future<entity>`.
+        //This is a template so that checking whether `deferred` is copyable doesn't need `entity` to be complete
+        template <class Future, class = std::enable_if_t<!std::is_same_v<std::decay_t<Future>, deferred>>>
+        explicit deferred (Future value);
+
+        /// Return whether the value is available yet.
+        bool ready() const;
+
+        /// Block until the value is available.
+        void wait() const;
+
+        /// Get the value, blocking until it is available.
+        /// \throws whatever exception was stored in the future, if any.
+        auto get() const -> const entity&;
+
+    private:
+        //The future can't be held directly, as `entity` isn't complete yet
+        struct state;
+        std::shared_ptr<const state> m_state;
     };
 
     /// An entity within the Koura templating language.
     ///
-    /// Can be text, a number, an object (associative array) or sequence.
+    /// Can be text, a number (a 64-bit integer), a real number, a boolean, an object (associative array)
+    /// or sequence.
+    /// Sequences can also be produced lazily by a `koura::generator`, and any value can be
+    /// fetched asynchronously by a `koura::deferred`.
+    /// An entity can also refer to a value of a user type in place, see `koura::ref`.
     class entity {
     public:
         /// Used to distinguish the type of an entity.
         enum class type {
-            text, number, object, sequence
+            text, number, object, sequence, real, boolean
         };
 
         entity () = default;
-        entity (text_t value) : m_type{type::text}, m_value{std::move(value)} {}
-        entity (number_t value) : m_type{type::number}, m_value{std::move(value)} {}
-        entity (object_t value) : m_type{type::object}, m_value{std::move(value)} {}
-        entity (sequence_t value) : m_type{type::sequence}, m_value{std::move(value)} {}
+        entity (text_t value) : m_value{std::in_place_type<text_t>, std::move(value)} {}
+        entity (object_t value) : m_value{std::in_place_type<object_t>, std::move(value)} {}
+        entity (sequence_t value) : m_value{std::in_place_type<sequence_t>, std::move(value)} {}
+        entity (generator value) : m_value{std::move(value)} {}
+        entity (detail::bound_ref value) : m_value{value} {}
+        entity (deferred value) : m_value{std::move(value)} {}
+
+        /// Create a number, real number or boolean entity, depending on whether `T` is an integer,
+        /// floating point or `bool` type. Unsigned integers above the maximum of `number_t` wrap around.
+        template <class T, class = std::enable_if_t<std::is_arithmetic_v<T>>>
+        entity (T value) {
+            if constexpr (std::is_same_v<T, bool>) {
+                m_value.template emplace<boolean_t>(value);
+            }
+            else if constexpr (std::is_floating_point_v<T>) {
+                m_value.template emplace<real_t>(value);
+            }
+            else {
+                m_value.template emplace<number_t>(static_cast<number_t>(value));
+            }
+        }
 
         /// Get the type of this entity.
-        auto get_type() -> type { return m_type; }
+        /// For bound entities, this is the type of the value they refer to, and generators are sequences.
+        /// For deferred entities, this is the type of their value, so it blocks until the value is available,
+        /// even in the middle of an async render. Code which mustn't block, such as custom expression handlers,
+        /// should check `get_if<deferred>()` and `deferred::ready()` first.
+        auto get_type() const -> type;
+
+        /// Return whether or not this entity refers to a user value, rather than storing its own.
+        bool is_bound() const { return std::holds_alternative<detail::bound_ref>(m_value); }
+
+        /// Get the reference to the user value of a bound entity.
+        auto get_bound() const -> const detail::bound_ref& { return std::get<detail::bound_ref>(m_value); }
+
+        /// Get the value of the entity as the given type.
+        /// \requires `T` is one of `number_t`, `real_t`, `boolean_t`, `text_t`, `object_t`, `sequence_t`,
+        /// `generator` or `deferred`.
+        /// \throws `std::bad_variant_access` if this entity does not store a `T`.
+        template <class T>
+        auto get_value() -> T& { return std::get<T>(m_value); }
 
         /// Get the value of the entity as the given type.
-        /// \requires `T` is one of `number_t`, `text_t`, `object_t` or `sequence_t`.
-        /// \throws `koura::wrong_entity_type` if this entity does not store a `T`.
         template <class T>
-        auto get_value() -> T& { return std::any_cast<T&>(m_value); }
+        auto get_value() const -> const T& { return std::get<T>(m_value); }
+
+        /// Get a pointer to the value of the entity if it stores a `T`, or `nullptr` if it doesn't.
+        template <class T>
+        auto get_if() -> T* { return std::get_if<T>(&m_value); }
+
+        /// Get a pointer to the value of the entity if it stores a `T`, or `nullptr` if it doesn't.
+        template <class T>
+        auto get_if() const -> const T* { return std::get_if<T>(&m_value); }
 
     private:
-        type m_type;
-        std::any m_value;
+        //Alternatives are in the same order as `type`, so the index is the type.
+        //Text is stored inline, so short strings never allocate.
+        std::variant<text_t, number_t, object_t, sequence_t, real_t, boolean_t, generator, detail::bound_ref, deferred> m_value;
     };
 
+    template <class T>
+    auto ref (const T& value) -> entity;
+
+    namespace detail {
+        /// How to read a value of some user type through a `bound_ref`.
+        struct value_binding {
+            entity::type kind;
+            std::string_view (*text)(const void*);
+            number_t (*number)(const void*);
+            real_t (*real)(const void*);
+            boolean_t (*boolean)(const void*);
+            entity (*field)(const void*, symbol);
+            std::size_t (*size)(const void*);
+            entity (*element)(const void*, std::size_t);
+        };
 
-    /// Manages all of the Koura variables.
-    class context {
-    public:
-        /// Add an entity to the context with the key `key` and the value `value` to the context.
         template <class T>
-        void add_entity (const std::string& key, T&& value) {
-            m_entities[key] = entity{std::forward<T>(value)};
+        struct is_vector : std::false_type {};
+
+        template <class T, class Alloc>
+        struct is_vector<std::vector<T, Alloc>> : std::true_type {};
+    }
+
+    inline auto entity::get_type() const -> type {
+        if (auto ref = std::get_if<detail::bound_ref>(&m_value)) {
+            return ref->binding->kind;
         }
+        if (std::holds_alternative<generator>(m_value)) {
+            return type::sequence;
+        }
+        if (auto value = std::get_if<deferred>(&m_value)) {
+            return value->get().get_type();
+        }
+        return static_cast<type>(m_value.index());
+    }
 
-        /// Gets a reference to the entity with the given key.
-        /// \throws `std::out_of_range` if there is no entity matching `key`.
-        auto get_entity(const std::string& key) -> entity& { return m_entities.at(key); }
+    struct deferred::state {
+        std::shared_future<entity> value;
+    };
 
+    template <class Future, class>
+    deferred::deferred (Future value) :
+        m_state{std::make_shared<const state>(state{std::shared_future<entity>{std::move(value)}})}
+    {}
 
-        /// Return whether or not an entity with the given name exists
-        bool contains(const std::string& key) { return m_entities.count(key); }
+    inline bool deferred::ready() const {
+        return m_state->value.wait_for(std::chrono::seconds{0}) == std::future_status::ready;
+    }
+
+    inline void deferred::wait() const { m_state->value.wait(); }
+
+    inline auto deferred::get() const -> const entity& { return m_state->value.get(); }
+
+    /// Create a deferred entity whose value is computed by calling `fetch` on another thread.
+    /// The call starts straight away, so several slow lookups made up front run concurrently.
+    template <class F>
+    auto defer (F fetch) -> entity {
+        return deferred{std::async(std::launch::async, [fetch = std::move(fetch)]() mutable -> entity {
+            return fetch();
+        }).share()};
+    }
+
+    /// Describes the fields of the user type `T` which templates can read.
+    /// Specialise this with a static `fields` member created by `koura::bind`:
+    ///
+    /// ```
+    /// template <>
+    /// struct koura::binding<customer> {
+    ///     static inline const auto fields = koura::bind(&customer::name, "name").bind(&customer::id, "id");
+    /// };
+    /// ```
+    template <class T>
+    struct binding;
+
+    /// A table of named fields of `T`, created by `koura::bind`.
+    template <class T>
+    class field_table {
+    public:
+        /// Add `member` to the table under the name `name`.
+        template <class U>
+        auto bind (U T::* member, std::string_view name) -> field_table& {
+            m_fields.emplace_back(symbol{name}, [member](const T& object) { return ref(object.*member); });
+            return *this;
+        }
+
+        /// Get a bound entity which refers to the field of `object` called `name`.
+        /// \throws `koura::render_error` if there is no such field.
+        auto get (const T& object, symbol name) const -> entity {
+            for (auto&& [field_name, getter] : m_fields) {
+                if (field_name == name) {
+                    return getter(object);
+                }
+            }
+            throw render_error{};
+        }
 
     private:
-        std::unordered_map<std::string, entity> m_entities;
+        std::vector<std::pair<symbol, std::function<entity(const T&)>>> m_fields;
     };
 
-    /// All of the standard Koura text filters.
-    namespace filters {
-        /// Capitalises the given text
-        inline std::string capitalise (std::string_view text, context&) {
-            std::string ret {text};
-            for (auto&& c : ret) {
-                c = std::toupper(c);
+    /// Create a field table for `T` containing `member` under the name `name`.
+    /// More fields can be added by chaining calls to `field_table::bind`.
+    template <class T, class U>
+    auto bind (U T::* member, std::string_view name) -> field_table<T> {
+        field_table<T> table;
+        table.bind(member, name);
+        return table;
+    }
+
+    namespace detail {
+        template <class T>
+        auto binding_of() -> const value_binding& {
+            static const value_binding binding = [] {
+                value_binding b{};
+                if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+                    b.kind = entity::type::text;
+                    b.text = [](const void* p) -> std::string_view { return *static_cast<const T*>(p); };
+                }
+                else if constexpr (std::is_same_v<T, bool>) {
+                    b.kind = entity::type::boolean;
+                    b.boolean = [](const void* p) -> boolean_t { return *static_cast<const T*>(p); };
+                }
+                else if constexpr (std::is_floating_point_v<T>) {
+                    b.kind = entity::type::real;
+                    b.real = [](const void* p) { return static_cast<real_t>(*static_cast<const T*>(p)); };
+                }
+                else if constexpr (std::is_arithmetic_v<T>) {
+                    b.kind = entity::type::number;
+                    b.number = [](const void* p) { return static_cast<number_t>(*static_cast<const T*>(p)); };
+                }
+                else if constexpr (is_vector<T>::value) {
+                    b.kind = entity::type::sequence;
+                    b.size = [](const void* p) { return static_cast<const T*>(p)->size(); };
+                    b.element = [](const void* p, std::size_t i) { return koura::ref((*static_cast<const T*>(p))[i]); };
+                }
+                else {
+                    b.kind = entity::type::object;
+                    b.field = [](const void* p, symbol name) {
+                        return koura::binding<T>::fields.get(*static_cast<const T*>(p), name);
+                    };
+                }
+                return b;
+            }();
+            return binding;
+        }
+
+        /// Get the text of a text entity, whether it's stored or bound.
+        inline auto text_of (const entity& ent) -> std::string_view {
+            if (ent.is_bound()) {
+                auto& ref = ent.get_bound();
+                return ref.binding->text(ref.object);
+            }
+            return ent.get_value<text_t>();
+        }
+
+        /// Get the value of a number entity, whether it's stored or bound.
+        inline auto number_of (const entity& ent) -> number_t {
+            if (ent.is_bound()) {
+                auto& ref = ent.get_bound();
+                return ref.binding->number(ref.object);
+            }
+            return ent.get_value<number_t>();
+        }
+
+        /// Get the value of a real number entity, whether it's stored or bound.
+        inline auto real_of (const entity& ent) -> real_t {
+            if (ent.is_bound()) {
+                auto& ref = ent.get_bound();
+                return ref.binding->real(ref.object);
+            }
+            return ent.get_value<real_t>();
+        }
+
+        /// Get the value of a boolean entity, whether it's stored or bound.
+        inline auto boolean_of (const entity& ent) -> boolean_t {
+            if (ent.is_bound()) {
+                auto& ref = ent.get_bound();
+                return ref.binding->boolean(ref.object);
+            }
+            return ent.get_value<boolean_t>();
+        }
+
+        /// Write the text of a text, number, real number or boolean entity, which is what variables render.
+        /// Numbers are written to `buffer` without allocating, and the result may point into it.
+        /// Real numbers are written in the shortest form which reads back as the same value.
+        /// \throws `koura::render_error` if `ent` is an object or sequence.
+        inline auto scalar_text (const entity& ent, char (&buffer)[32]) -> std::string_view {
+            std::to_chars_result written;
+            switch (ent.get_type()) {
+            case entity::type::text:
+                return text_of(ent);
+            case entity::type::boolean:
+                return boolean_of(ent) ? "true" : "false";
+            case entity::type::number:
+                written = std::to_chars(std::begin(buffer), std::end(buffer), number_of(ent));
+                break;
+            case entity::type::real:
+                written = std::to_chars(std::begin(buffer), std::end(buffer), real_of(ent));
+                break;
+            default:
+                throw render_error{};
+            }
+            return {buffer, static_cast<std::size_t>(written.ptr - buffer)};
+        }
+
+        /// Get the value of `ent` to give to a formatting filter, where `text` is its text.
+        inline auto format_value_of (const entity& ent, std::string_view text) -> format_value {
+            switch (ent.get_type()) {
+            case entity::type::number:
+                return number_of(ent);
+            case entity::type::real:
+                return real_of(ent);
+            default:
+                return text;
             }
-            return ret;
         }
     }
 
+    /// Make an entity which reads `value` in place rather than copying it.
+    /// `value` can be text, a number, a `std::vector` of bindable values or a type with a `koura::binding`.
+    /// \requires `value` outlives the entity.
+    template <class T>
+    auto ref (const T& value) -> entity {
+        return entity{detail::bound_ref{&value, &detail::binding_of<T>()}};
+    }
+
 
-    class engine;
+    class context;
 
     namespace detail {
-        inline void eat_single_trailing_whitespace (std::istream& in) {
-            if (in.peek() == '\n') in.get();
+        struct loop_frame;
+        inline bool loops_over (const context& ctx, const std::vector<symbol>& path);
+    }
+
+    /// Manages all of the Koura variables.
+    ///
+    /// A context can be a child scope of another context. Lookups which miss in the child fall through
+    /// to its parent, so a scope only needs to hold the entities it shadows.
+    class context {
+    public:
+        context() = default;
+
+        /// Create a child scope of this context, which must outlive it.
+        /// The scope's own bookkeeping is allocated from `resource`.
+        auto new_scope (std::pmr::memory_resource* resource = std::pmr::get_default_resource()) -> context {
+            return context{this, resource};
         }
 
-        inline bool is_block_tag (std::string_view tag) {
-            return (tag == "if" || tag == "for");
+        /// Add an entity to the context with the key `key` and the value `value` to the context.
+        template <class T>
+        void add_entity (symbol key, T&& value) {
+            m_entities[key] = entity{std::forward<T>(value)};
         }
 
-        inline void stream_up_to_tag (std::istream& in, std::ostream& out) {
-            char c;
-            while (c = in.get(), in) {
-                if (c == '{') {
-                    auto next = in.peek();
-                    if (next == '{' || next == '%') {
-                        in.unget();
-                        return;
-                    }
+        /// Bind the key `key` to `value` in this scope without copying it.
+        /// Rebinding a key which is already bound just replaces the reference.
+        /// Templates can't change bound entities with `set` tags.
+        /// \requires `value` outlives the binding.
+        void bind_entity (symbol key, entity& value) {
+            if (m_binding.second && m_binding.first == key) {
+                m_binding.second = &value;
+                return;
+            }
+            for (auto&& [name, ent] : m_bindings) {
+                if (name == key) {
+                    ent = &value;
+                    return;
                 }
-                out << c;
             }
+
+            //The first binding, such as a loop variable, is kept inline, so loop scopes don't allocate
+            if (!m_binding.second) {
+                m_binding = {key, &value};
+                return;
+            }
+            m_bindings.emplace_back(key, &value);
         }
 
-        inline void skip_up_to_tag (std::istream& in, std::ostream& out) {
-            char c;
-            while (c = in.get(), in) {
-                if (c == '{') {
-                    auto next = in.peek();
-                    if (next == '{' || next == '%') {
-                        in.unget();
-                        return;
-                    }
-                }
+        /// Gets a reference to the entity with the given key.
+        /// \throws `std::out_of_range` if there is no entity matching `key`.
+        auto get_entity(symbol key) -> entity& {
+            if (auto ent = find_entity(key)) {
+                return *ent;
             }
+            throw std::out_of_range{"No entity named " + std::string{key.name()}};
         }
 
-        inline void eat_whitespace (std::istream& in) {
-            while (std::isspace(in.peek())) {
-                in.get();
+        /// Gets a pointer to the entity with the given key, or `nullptr` if there is none.
+        auto find_entity(symbol key) -> entity* {
+            if (m_binding.second && m_binding.first == key) {
+                return m_binding.second;
+            }
+            for (auto&& [name, ent] : m_bindings) {
+                if (name == key) {
+                    return ent;
+                }
             }
+
+            auto it = m_entities.find(key);
+            if (it != m_entities.end()) {
+                return &it->second;
+            }
+
+            return m_parent ? m_parent->find_entity(key) : nullptr;
         }
 
-        inline char peek (std::istream& in) {
-            eat_whitespace(in);
-            return in.peek();
+        /// Return whether or not an entity with the given name exists
+        bool contains(symbol key) { return find_entity(key) != nullptr; }
+
+        /// Return whether the entity with the given key was bound with `bind_entity`, such as a loop variable,
+        /// rather than being owned by the context.
+        bool is_bound(symbol key) const {
+            if (m_binding.second && m_binding.first == key) {
+                return true;
+            }
+            for (auto&& binding : m_bindings) {
+                if (binding.first == key) {
+                    return true;
+                }
+            }
+            if (m_entities.count(key)) {
+                return false;
+            }
+            return m_parent && m_parent->is_bound(key);
         }
 
-        inline std::string get_identifier (std::istream& in) {
-            eat_whitespace(in);
-            std::string name = "";
-            while (std::isalpha(in.peek()) || in.peek() == '_') {
-                name += in.get();
+        /// Gets a reference to the entity named `name`.
+        /// Looking up entities by text never interns the text, so it's safe for names from user input.
+        /// \throws `std::out_of_range` if there is no entity named `name`.
+        template <class Name, class = std::enable_if_t<std::is_convertible_v<const Name&, std::string_view>>>
+        auto get_entity(const Name& name) -> entity& {
+            if (auto ent = find_entity(name)) {
+                return *ent;
             }
+            throw std::out_of_range{"No entity named " + std::string{std::string_view{name}}};
+        }
 
-            return name;
+        /// Gets a pointer to the entity named `name`, or `nullptr` if there is none.
+        template <class Name, class = std::enable_if_t<std::is_convertible_v<const Name&, std::string_view>>>
+        auto find_entity(const Name& name) -> entity* {
+            auto key = symbol::find(name);
+            return key ? find_entity(*key) : nullptr;
         }
 
-        inline entity& parse_nested_object (std::istream& in, entity& ent) {
-            if (ent.get_type() != entity::type::object) {
-                throw render_error{in};
-            }
+        /// Return whether or not an entity named `name` exists
+        template <class Name, class = std::enable_if_t<std::is_convertible_v<const Name&, std::string_view>>>
+        bool contains(const Name& name) { return find_entity(name) != nullptr; }
 
-            auto field_name = get_identifier(in);
-            auto& ent_obj = ent.get_value<object_t>();
+        /// Set the entity with the key `key` to `value`, like `add_entity`, and record the change
+        /// so that `live_render::update` re-renders whatever read it.
+        template <class T>
+        void update (symbol key, T&& value) {
+            add_entity(key, std::forward<T>(value));
+            m_changes.push_back({key});
+        }
 
-            if (!ent_obj.count(field_name)) {
-                throw render_error{in};
-            }
+        /// Record that the entity at `path`, such as a field of an object, was changed in place,
+        /// so that `live_render::update` re-renders whatever read it or anything inside it.
+        void mark_changed (std::vector<symbol> path) {
+            m_changes.push_back(std::move(path));
+        }
 
-            auto& nested = ent_obj.at(field_name);
+        /// Take the changes recorded by `update` and `mark_changed` since the last call.
+        auto take_changes() -> std::vector<std::vector<symbol>> {
+            return std::exchange(m_changes, {});
+        }
 
-            //We need to go deeper
-            if (in.peek() == '.') {
-                in.get();
-                auto& deeper = parse_nested_object(in, nested);
-                return deeper;
-            }
+    private:
+        friend struct detail::loop_frame;
+        friend bool detail::loops_over (const context& ctx, const std::vector<symbol>& path);
 
-            return nested;
+        context (context* parent, std::pmr::memory_resource* resource) : m_parent{parent}, m_bindings{resource} {}
+
+        context* m_parent = nullptr;
+        //The path of the sequence which a loop scope is iterating over
+        const std::vector<symbol>* m_iterating = nullptr;
+        std::pair<symbol, entity*> m_binding {{}, nullptr};
+        std::pmr::vector<std::pair<symbol, entity*>> m_bindings;
+        std::unordered_map<symbol, entity> m_entities;
+        std::vector<std::vector<symbol>> m_changes;
+    };
+
+    namespace detail::simd {
+        /// The instruction sets which text filters can use.
+        enum class level {
+            scalar, sse2, avx2
+        };
+
+        /// The best instruction set supported by this machine, detected once at runtime.
+        inline auto best_level() -> level {
+#if KOURA_HAS_X86_SIMD
+            static const auto best = __builtin_cpu_supports("avx2") ? level::avx2 : level::sse2;
+            return best;
+#else
+            return level::scalar;
+#endif
         }
 
-        inline entity& parse_named_entity (std::istream& in, context& ctx) {
-            auto name = get_identifier(in);
+#if KOURA_HAS_X86_SIMD
+        inline auto in_range (__m128i v, char lo, char hi) -> __m128i {
+            return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+        }
+
+        KOURA_TARGET_AVX2 inline auto in_range (__m256i v, char lo, char hi) -> __m256i {
+            return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+                                    _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+        }
+
+        inline auto any_of (__m128i v, char a) -> __m128i { return _mm_cmpeq_epi8(v, _mm_set1_epi8(a)); }
+
+        template <class... Chars>
+        auto any_of (__m128i v, char a, Chars... rest) -> __m128i {
+            return _mm_or_si128(any_of(v, a), any_of(v, rest...));
+        }
+
+        KOURA_TARGET_AVX2 inline auto any_of (__m256i v, char a) -> __m256i { return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(a)); }
+
+        template <class... Chars>
+        KOURA_TARGET_AVX2 auto any_of (__m256i v, char a, Chars... rest) -> __m256i {
+            return _mm256_or_si256(any_of(v, a), any_of(v, rest...));
+        }
+#endif
+
+        /// Characters which `escape_html` replaces.
+        struct html_special {
+            static bool scalar (char c) { return c == '&' || c == '<' || c == '>' || c == '"' || c == '\''; }
+#if KOURA_HAS_X86_SIMD
+            static auto sse2 (__m128i v) -> __m128i { return any_of(v, '&', '<', '>', '"', '\''); }
+            KOURA_TARGET_AVX2 static auto avx2 (__m256i v) -> __m256i { return any_of(v, '&', '<', '>', '"', '\''); }
+#endif
+        };
+
+        /// Characters which `escape_json` replaces: quotes, backslashes and control characters.
+        struct json_special {
+            static bool scalar (char c) { return c == '"' || c == '\\' || static_cast<unsigned char>(c) < 0x20; }
+#if KOURA_HAS_X86_SIMD
+            static auto sse2 (__m128i v) -> __m128i {
+                auto control = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(0x1f)), _mm_set1_epi8(0x1f));
+                return _mm_or_si128(control, any_of(v, '"', '\\'));
+            }
+            KOURA_TARGET_AVX2 static auto avx2 (__m256i v) -> __m256i {
+                auto control = _mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8(0x1f)), _mm256_set1_epi8(0x1f));
+                return _mm256_or_si256(control, any_of(v, '"', '\\'));
+            }
+#endif
+        };
+
+        /// Characters which `escape_url` percent-encodes: everything but RFC 3986 unreserved characters.
+        struct url_special {
+            static bool scalar (char c) {
+                auto lower = static_cast<char>(c | 0x20);
+                return !((lower >= 'a' && lower <= 'z') || (c >= '0' && c <= '9') ||
+                         c == '-' || c == '.' || c == '_' || c == '~');
+            }
+#if KOURA_HAS_X86_SIMD
+            static auto sse2 (__m128i v) -> __m128i {
+                auto lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+                auto unreserved = _mm_or_si128(_mm_or_si128(in_range(lower, 'a', 'z'), in_range(v, '0', '9')),
+                                               any_of(v, '-', '.', '_', '~'));
+                return _mm_xor_si128(unreserved, _mm_set1_epi8(-1));
+            }
+            KOURA_TARGET_AVX2 static auto avx2 (__m256i v) -> __m256i {
+                auto lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+                auto unreserved = _mm256_or_si256(_mm256_or_si256(in_range(lower, 'a', 'z'), in_range(v, '0', '9')),
+                                                  any_of(v, '-', '.', '_', '~'));
+                return _mm256_xor_si256(unreserved, _mm256_set1_epi8(-1));
+            }
+#endif
+        };
+
+        /// Flip the case of every character of `data` between `lo` and `hi`, which are both ASCII letters.
+        inline void flip_case (char* data, std::size_t size, char lo, char hi, level lvl) {
+            std::size_t i = 0;
+#if KOURA_HAS_X86_SIMD
+            if (lvl == level::avx2) {
+                i = [=]() KOURA_TARGET_AVX2 {
+                    std::size_t i = 0;
+                    for (; i + 32 <= size; i += 32) {
+                        auto p = reinterpret_cast<__m256i*>(data + i);
+                        auto v = _mm256_loadu_si256(p);
+                        auto flip = _mm256_and_si256(in_range(v, lo, hi), _mm256_set1_epi8(0x20));
+                        _mm256_storeu_si256(p, _mm256_xor_si256(v, flip));
+                    }
+                    return i;
+                }();
+            }
+            if (lvl != level::scalar) {
+                for (; i + 16 <= size; i += 16) {
+                    auto p = reinterpret_cast<__m128i*>(data + i);
+                    auto v = _mm_loadu_si128(p);
+                    auto flip = _mm_and_si128(in_range(v, lo, hi), _mm_set1_epi8(0x20));
+                    _mm_storeu_si128(p, _mm_xor_si128(v, flip));
+                }
+            }
+#endif
+            for (; i < size; ++i) {
+                if (data[i] >= lo && data[i] <= hi) {
+                    data[i] ^= 0x20;
+                }
+            }
+        }
+
+        /// Append `text` to `out`, replacing each character matched by `C` with `escape(c, out)`.
+        /// Each block of text is classified once, and every match in its mask is escaped before the next
+        /// block is loaded, so text with many matches costs no more than the scalar loop. Runs of characters
+        /// which don't need escaping are appended in bulk.
+        template <class C, class Escape>
+        void escape (std::string_view text, std::pmr::string& out, level lvl, Escape&& escape) {
+            auto data = text.data();
+            auto size = text.size();
+            std::size_t written = 0;
+            auto replace = [&](std::size_t at) {
+                out.append(data + written, at - written);
+                escape(data[at], out);
+                written = at + 1;
+            };
+
+            std::size_t i = 0;
+#if KOURA_HAS_X86_SIMD
+            auto replace_all = [&](std::size_t base, unsigned mask) {
+                for (; mask; mask &= mask - 1) {
+                    replace(base + __builtin_ctz(mask));
+                }
+            };
+            if (lvl == level::avx2) {
+                [&]() KOURA_TARGET_AVX2 {
+                    for (; i + 32 <= size; i += 32) {
+                        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+                        replace_all(i, static_cast<unsigned>(_mm256_movemask_epi8(C::avx2(v))));
+                    }
+                }();
+            }
+            if (lvl != level::scalar) {
+                for (; i + 16 <= size; i += 16) {
+                    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+                    replace_all(i, static_cast<unsigned>(_mm_movemask_epi8(C::sse2(v))));
+                }
+            }
+#endif
+            for (; i < size; ++i) {
+                if (C::scalar(data[i])) {
+                    replace(i);
+                }
+            }
+            out.append(data + written, size - written);
+        }
+
+        inline void upper (std::string_view text, std::pmr::string& out, level lvl) {
+            auto start = out.size();
+            out.append(text);
+            flip_case(out.data() + start, text.size(), 'a', 'z', lvl);
+        }
+
+        inline void lower (std::string_view text, std::pmr::string& out, level lvl) {
+            auto start = out.size();
+            out.append(text);
+            flip_case(out.data() + start, text.size(), 'A', 'Z', lvl);
+        }
+
+        inline void escape_html (std::string_view text, std::pmr::string& out, level lvl) {
+            escape<html_special>(text, out, lvl, [](char c, std::pmr::string& out) {
+                switch (c) {
+                case '&': out += "&amp;"; break;
+                case '<': out += "&lt;"; break;
+                case '>': out += "&gt;"; break;
+                case '"': out += "&quot;"; break;
+                default: out += "&#39;"; break;
+                }
+            });
+        }
+
+        /// Percent-encode `text` onto `out`. Most text has a character to encode every few bytes, so rather
+        /// than appending each run, this grows `out` to the longest the result can be and writes straight into
+        /// it, copying runs which fit in a block with a single vector store.
+        inline void escape_url (std::string_view text, std::pmr::string& out, level lvl) {
+            auto data = text.data();
+            auto size = text.size();
+            auto start = out.size();
+            //Vector stores may write up to a block past the end of the result
+            out.resize(start + size * 3 + 32);
+            auto dst = out.data() + start;
+            std::size_t written = 0;
+
+            auto copy = [&](std::size_t to) {
+                auto count = to - written;
+#if KOURA_HAS_X86_SIMD
+                if (lvl != level::scalar && count <= 16 && written + 16 <= size) {
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst),
+                                     _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + written)));
+                }
+                else
+#endif
+                {
+                    std::memcpy(dst, data + written, count);
+                }
+                dst += count;
+            };
+            auto encode = [&](std::size_t at) {
+                constexpr const char* hex = "0123456789ABCDEF";
+                copy(at);
+                auto byte = static_cast<unsigned char>(data[at]);
+                dst[0] = '%';
+                dst[1] = hex[byte >> 4];
+                dst[2] = hex[byte & 0xf];
+                dst += 3;
+                written = at + 1;
+            };
+
+            std::size_t i = 0;
+#if KOURA_HAS_X86_SIMD
+            auto encode_all = [&](std::size_t base, unsigned mask) {
+                for (; mask; mask &= mask - 1) {
+                    encode(base + __builtin_ctz(mask));
+                }
+            };
+            if (lvl == level::avx2) {
+                [&]() KOURA_TARGET_AVX2 {
+                    for (; i + 32 <= size; i += 32) {
+                        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+                        encode_all(i, static_cast<unsigned>(_mm256_movemask_epi8(url_special::avx2(v))));
+                    }
+                }();
+            }
+            if (lvl != level::scalar) {
+                for (; i + 16 <= size; i += 16) {
+                    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+                    encode_all(i, static_cast<unsigned>(_mm_movemask_epi8(url_special::sse2(v))));
+                }
+            }
+#endif
+            for (; i < size; ++i) {
+                if (url_special::scalar(data[i])) {
+                    encode(i);
+                }
+            }
+            copy(size);
+            out.resize(static_cast<std::size_t>(dst - out.data()));
+        }
+
+        inline void escape_json (std::string_view text, std::pmr::string& out, level lvl) {
+            escape<json_special>(text, out, lvl, [](char c, std::pmr::string& out) {
+                switch (c) {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                case '\b': out += "\\b"; break;
+                case '\f': out += "\\f"; break;
+                default:
+                {
+                    constexpr const char* hex = "0123456789abcdef";
+                    out += "\\u00";
+                    out += hex[static_cast<unsigned char>(c) >> 4];
+                    out += hex[c & 0xf];
+                }
+                }
+            });
+        }
+    }
+
+    namespace detail {
+        /// Get the number a formatting filter was given, reading it from text if it was given text.
+        /// Text is read as a whole number where possible, so large whole numbers aren't rounded.
+        /// \throws `koura::render_error` if the text isn't a number
+        inline auto number_value (const format_value& value) -> std::variant<number_t, real_t> {
+            auto text = std::get_if<std::string_view>(&value);
+            if (!text) {
+                return std::holds_alternative<number_t>(value) ? std::variant<number_t, real_t>{std::get<number_t>(value)}
+                                                               : std::variant<number_t, real_t>{std::get<real_t>(value)};
+            }
+
+            auto first = text->data();
+            auto last = first + text->size();
+            number_t whole;
+            if (auto [end, err] = std::from_chars(first, last, whole); err == std::errc{} && end == last) {
+                return whole;
+            }
+            real_t real;
+            if (auto [end, err] = std::from_chars(first, last, real); err != std::errc{} || end != last) {
+                throw render_error{};
+            }
+            return real;
+        }
+
+        /// Get the text of the value a formatting filter was given.
+        /// Numbers are written to `buffer`, and the result may point into it.
+        inline auto format_text (const format_value& value, char (&buffer)[32]) -> std::string_view {
+            if (auto text = std::get_if<std::string_view>(&value)) {
+                return *text;
+            }
+            auto written = std::holds_alternative<number_t>(value)
+                ? std::to_chars(std::begin(buffer), std::end(buffer), std::get<number_t>(value))
+                : std::to_chars(std::begin(buffer), std::end(buffer), std::get<real_t>(value));
+            return {buffer, static_cast<std::size_t>(written.ptr - buffer)};
+        }
+
+        /// Append the decimal number `text` to `out` with its thousands separated by commas.
+        /// \returns false, without appending anything, if `text` isn't written as a plain decimal number.
+        inline bool group_thousands (std::string_view text, std::pmr::string& out) {
+            auto is_digit = [](char c) { return c >= '0' && c <= '9'; };
+            auto sign = text.substr(0, !text.empty() && text.front() == '-');
+            auto number = text.substr(sign.size());
+            auto point = std::min(number.find('.'), number.size());
+            auto whole = number.substr(0, point);
+            auto fraction = number.substr(point);
+            if (whole.empty() || !std::all_of(whole.begin(), whole.end(), is_digit) ||
+                (!fraction.empty() && !std::all_of(fraction.begin() + 1, fraction.end(), is_digit))) {
+                return false;
+            }
+
+            out.append(sign);
+            for (std::size_t i = 0; i < whole.size(); ++i) {
+                if (i != 0 && (whole.size() - i) % 3 == 0) {
+                    out += ',';
+                }
+                out += whole[i];
+            }
+            out.append(fraction);
+            return true;
+        }
+    }
+
+    /// All of the standard Koura text filters.
+    ///
+    /// The streaming filters use SSE2 or AVX2 where the machine supports them, falling back to scalar code.
+    namespace filters {
+        /// Converts ASCII letters in the given text to upper case, appending the result to `out`
+        inline void upper (std::string_view text, std::pmr::string& out, context&) {
+            detail::simd::upper(text, out, detail::simd::best_level());
+        }
+
+        /// Capitalises the given text.
+        /// The engine's `capitalise` filter streams into its buffer with `upper` instead.
+        inline std::string capitalise (std::string_view text, context& ctx) {
+            std::pmr::string ret;
+            upper(text, ret, ctx);
+            return std::string{ret};
+        }
+
+        /// Converts ASCII letters in the given text to lower case, appending the result to `out`
+        inline void lower (std::string_view text, std::pmr::string& out, context&) {
+            detail::simd::lower(text, out, detail::simd::best_level());
+        }
+
+        /// Escapes `&`, `<`, `>`, `"` and `'` as HTML character references, appending the result to `out`
+        inline void escape_html (std::string_view text, std::pmr::string& out, context&) {
+            detail::simd::escape_html(text, out, detail::simd::best_level());
+        }
+
+        /// Percent-encodes everything but unreserved URL characters, appending the result to `out`
+        inline void escape_url (std::string_view text, std::pmr::string& out, context&) {
+            detail::simd::escape_url(text, out, detail::simd::best_level());
+        }
+
+        /// Escapes the given text for use inside a JSON string, appending the result to `out`
+        inline void escape_json (std::string_view text, std::pmr::string& out, context&) {
+            detail::simd::escape_json(text, out, detail::simd::best_level());
+        }
+
+        /// Removes leading and trailing whitespace from the given text, appending the result to `out`
+        inline void trim (std::string_view text, std::pmr::string& out, context&) {
+            auto is_space = [](char c) { return std::isspace(static_cast<unsigned char>(c)); };
+            while (!text.empty() && is_space(text.front())) {
+                text.remove_prefix(1);
+            }
+            while (!text.empty() && is_space(text.back())) {
+                text.remove_suffix(1);
+            }
+            out.append(text);
+        }
+
+        /// Writes the given number with `decimals` digits after the decimal point, 2 by default,
+        /// appending the result to `out`. Whole numbers are written exactly, however large they are.
+        /// \throws `koura::render_error` if the value isn't a number or `decimals` is more than 64
+        inline void fixed (const format_value& value, std::pmr::string& out, std::optional<std::size_t> decimals) {
+            auto places = decimals.value_or(2);
+            if (places > 64) {
+                throw render_error{};
+            }
+
+            char buffer[400];
+            auto number = detail::number_value(value);
+            if (auto whole = std::get_if<number_t>(&number)) {
+                out.append(buffer, std::to_chars(std::begin(buffer), std::end(buffer), *whole).ptr);
+                if (places > 0) {
+                    out += '.';
+                    out.append(places, '0');
+                }
+                return;
+            }
+
+            auto written = std::to_chars(std::begin(buffer), std::end(buffer), std::get<real_t>(number),
+                                         std::chars_format::fixed, static_cast<int>(places));
+            if (written.ec != std::errc{}) {
+                throw render_error{};
+            }
+            out.append(buffer, written.ptr);
+        }
+
+        /// Separates the thousands of the whole part of the given number with commas, appending the result to `out`
+        /// \throws `koura::render_error` if the value isn't a finite number
+        inline void thousands (const format_value& value, std::pmr::string& out, std::optional<std::size_t>) {
+            auto text = std::get_if<std::string_view>(&value);
+            if (text && detail::group_thousands(*text, out)) {
+                return;
+            }
+
+            //Anything else, such as a real number which would be written as 1e+22, is written out in full first
+            char buffer[400];
+            auto number = detail::number_value(value);
+            auto written = std::holds_alternative<number_t>(number)
+                ? std::to_chars(std::begin(buffer), std::end(buffer), std::get<number_t>(number))
+                : std::to_chars(std::begin(buffer), std::end(buffer), std::get<real_t>(number), std::chars_format::fixed);
+            auto size = static_cast<std::size_t>(written.ptr - buffer);
+            if (written.ec != std::errc{} || !detail::group_thousands({buffer, size}, out)) {
+                throw render_error{};
+            }
+        }
+
+        /// Pads the given value with spaces on the left to at least `width` characters, appending the result to `out`
+        /// \throws `koura::render_error` if no width is given
+        inline void pad (const format_value& value, std::pmr::string& out, std::optional<std::size_t> width) {
+            if (!width) {
+                throw render_error{};
+            }
+            char buffer[32];
+            auto text = detail::format_text(value, buffer);
+            out.append(*width > text.size() ? *width - text.size() : 0, ' ');
+            out.append(text);
+        }
+
+        /// Pads the given number with zeros after any sign to at least `width` characters,
+        /// appending the result to `out`
+        /// \throws `koura::render_error` if no width is given
+        inline void zero_pad (const format_value& value, std::pmr::string& out, std::optional<std::size_t> width) {
+            if (!width) {
+                throw render_error{};
+            }
+            char buffer[32];
+            auto text = detail::format_text(value, buffer);
+            auto sign = text.substr(0, !text.empty() && (text.front() == '-' || text.front() == '+'));
+            out.append(sign);
+            out.append(*width > text.size() ? *width - text.size() : 0, '0');
+            out.append(text.substr(sign.size()));
+        }
+    }
+
+
+    namespace detail {
+        inline void eat_whitespace (std::istream& in) {
+            while (std::isspace(in.peek())) {
+                in.get();
+            }
+        }
+
+        inline char peek (std::istream& in) {
+            eat_whitespace(in);
+            return in.peek();
+        }
+
+        inline std::string get_identifier (std::istream& in) {
+            eat_whitespace(in);
+            std::string name = "";
+            while (std::isalpha(in.peek()) || in.peek() == '_') {
+                name += in.get();
+            }
+
+            return name;
+        }
+
+        /// Read everything from `in` up to and including the next `end`.
+        /// \throws `koura::render_error` if the stream ends first.
+        inline std::string read_through (std::istream& in, std::string_view end) {
+            std::string text;
+            while (text.size() < end.size() || text.compare(text.size() - end.size(), end.size(), end) != 0) {
+                auto c = in.get();
+                if (c == std::char_traits<char>::eof()) {
+                    throw render_error{in};
+                }
+                text += static_cast<char>(c);
+            }
+            return text;
+        }
+
+        inline entity& parse_nested_object (std::istream& in, entity& ent) {
+            if (ent.get_type() != entity::type::object || ent.is_bound()) {
+                throw render_error{in};
+            }
+
+            auto field_name = symbol::find(get_identifier(in));
+            auto& ent_obj = ent.get_value<object_t>();
+
+            auto field = field_name ? ent_obj.find(*field_name) : ent_obj.end();
+            if (field == ent_obj.end()) {
+                throw render_error{in};
+            }
+
+            auto& nested = field->second;
+
+            //We need to go deeper
+            if (in.peek() == '.') {
+                in.get();
+                auto& deeper = parse_nested_object(in, nested);
+                return deeper;
+            }
+
+            return nested;
+        }
+
+        /// Parse a dotted name from `in` and look it up in `ctx`.
+        /// This uses `entity::get_type`, so it blocks on deferred entities which aren't available yet.
+        inline entity& parse_named_entity (std::istream& in, context& ctx) {
+            auto name = get_identifier(in);
+
+            auto& ent = ctx.get_entity(name);
+
+            eat_whitespace(in);
+
+            auto type = ent.get_type();
+            if (type == entity::type::text || type == entity::type::number ||
+                type == entity::type::real || type == entity::type::boolean) {
+                return ent;
+            }
+            else if (type == entity::type::object) {
+                auto next = in.peek();
+
+                if (next == '.') {
+                    in.get();
+                    return parse_nested_object(in, ent);
+                }
+            }
+            else if (type == entity::type::sequence) {
+                return ent;
+            }
+
+            throw render_error{in};
+        }
+
+        inline koura::entity parse_entity (std::istream& in, koura::context& ctx) {
+            auto c = peek(in);
+            //String literal
+            if (c == '\'') {
+                in.get();
+                koura::text_t text;
+                while (in.peek() != '\'') {
+                    text += in.get();
+                }
+                in.get();
+                return entity{text};
+            }
+            //Number literal
+            else if (std::isdigit(c)) {
+                koura::number_t num;
+                in >> num;
+                return entity{num};
+            }
+            //List literal
+            else if (c == '[') {
+                //TODO
+            }
+            //Named entity
+            else {
+                return parse_named_entity(in,ctx);
+            }
+
+            throw render_error{in};
+        }
+
+
+        inline void expect_text(std::istream& in, std::string_view expected) {
+            std::string got;
+            in >> got;
+            if (got != expected) {
+                throw render_error{in};
+            }
+        }
+
+        /// Every entity is truthy except a `false` boolean.
+        inline bool is_truthy (const entity& ent) {
+            return ent.get_type() != entity::type::boolean || boolean_of(ent);
+        }
+    }
+
+    /// Finds the text of the template called `name` for `include` and `extends` tags.
+    /// Returns a handle which keeps the text alive, along with the text itself.
+    using template_loader = std::function<std::pair<std::shared_ptr<const void>, std::string_view>(std::string_view name)>;
+
+    namespace detail {
+        inline bool is_space (char c) { return std::isspace(static_cast<unsigned char>(c)); }
+        inline bool is_identifier_char (char c) { return std::isalpha(static_cast<unsigned char>(c)) || c == '_'; }
+
+        /// A read cursor over contiguous template text.
+        class source_cursor {
+        public:
+            explicit source_cursor (std::string_view text) : m_text{text} {}
+
+            bool done() const { return m_pos >= m_text.size(); }
+            char peek (std::size_t offset = 0) const {
+                return m_pos + offset < m_text.size() ? m_text[m_pos + offset] : '\0';
+            }
+            char get() { return done() ? '\0' : m_text[m_pos++]; }
+            auto pos() const -> std::size_t { return m_pos; }
+            void seek (std::size_t pos) { m_pos = pos; }
+            auto text() const -> std::string_view { return m_text; }
+            auto slice (std::size_t from, std::size_t to) const -> std::string_view {
+                return m_text.substr(from, to - from);
+            }
+
+            /// Advance to the next `{{` or `{%`, or to the end of the text if there isn't one.
+            void skip_to_tag() {
+                auto begin = m_text.data();
+                auto end = begin + m_text.size();
+                auto it = begin + m_pos;
+
+                while (it < end) {
+                    it = static_cast<const char*>(std::memchr(it, '{', end - it));
+                    if (!it) {
+                        it = end;
+                        break;
+                    }
+                    if (it + 1 < end && (it[1] == '{' || it[1] == '%')) {
+                        break;
+                    }
+                    ++it;
+                }
+
+                m_pos = it - begin;
+            }
+
+        private:
+            std::string_view m_text;
+            std::size_t m_pos = 0;
+        };
+
+        inline void eat_whitespace (source_cursor& in) {
+            while (is_space(in.peek())) {
+                in.get();
+            }
+        }
+
+        inline void eat_single_trailing_whitespace (source_cursor& in) {
+            if (in.peek() == '\n') in.get();
+        }
+
+        inline auto get_identifier (source_cursor& in) -> std::string_view {
+            eat_whitespace(in);
+            auto start = in.pos();
+            while (is_identifier_char(in.peek())) {
+                in.get();
+            }
+            return in.slice(start, in.pos());
+        }
+
+        inline void expect (source_cursor& in, char c) {
+            if (in.get() != c) {
+                throw render_error{};
+            }
+        }
+
+        inline void expect_tag_end (source_cursor& in) {
+            eat_whitespace(in);
+            expect(in, '%');
+            expect(in, '}');
+            eat_single_trailing_whitespace(in);
+        }
+
+        /// A tag argument: either a literal entity or a dotted path which has been split into interned segments.
+        struct operand {
+            std::vector<symbol> path;
+            entity literal;
+        };
+
+        /// The operations which a compiled template is made up of.
+        enum class opcode {
+            literal,  ///< Write `text` to the output.
+            variable, ///< Write the entity at `arg` to the output after passing it through `filters`.
+            branch,   ///< Jump to `jump` if `arg` is not truthy (or if it is, when `negate` is set).
+            jump,     ///< Jump to `jump`.
+            loop,     ///< Bind `name` to each element of `arg` in turn, or jump to `jump` if there are none.
+            end_loop, ///< Move on to the next element of the innermost loop and jump back to `jump`.
+            set,      ///< Assign `value` to the entity at `arg`.
+            flush,    ///< Flush the output, which hands buffered text on to an `output_sink`'s callback.
+            custom,   ///< Call the custom expression handler `name` with the rest of the tag in `args`.
+            cache,    ///< Write the text cached under `arg` and jump to `jump`, or start capturing it to cache for `value` seconds.
+            end_cache ///< Stop capturing the innermost `cache` block's text and store it.
+        };
+
+        /// A filter in a variable tag, with its argument if it has one, as in `{{ price | fixed: 2 }}`.
+        struct filter_call {
+            symbol name;
+            std::optional<std::size_t> arg {};
+        };
+
+        /// The operands, names and filters of a tag, which its `instruction` refers to by index.
+        struct tag_args {
+            operand arg;
+            operand value;
+            symbol name;
+            std::vector<filter_call> filters;
+            std::string_view args; ///< The rest of a custom tag, after its name.
+        };
+
+        /// One step of a program. Its tag's arguments are kept out of line in `compiled_program::tags`,
+        /// so an instruction fits in a cache line and the render loop walks a compact array.
+        struct instruction {
+            static constexpr auto no_tag = static_cast<std::size_t>(-1);
+
+            opcode op = opcode::literal;
+            bool negate = false;
+            std::size_t jump = 0;
+            std::size_t tag = no_tag; ///< The index of its `tag_args`, if it has any.
+            std::string_view text {};
+            std::string_view source {}; ///< The tag or text this was compiled from.
+            std::size_t line = 0;     ///< The line of its template which `source` starts on.
+        };
+
+        /// A compiled template's instructions, and the arguments of their tags.
+        /// Tags' arguments are stored in the order of the instructions which refer to them.
+        struct compiled_program {
+            std::vector<instruction> code;
+            std::vector<tag_args> tags;
+
+            auto args_of (const instruction& instr) const -> const tag_args& { return tags[instr.tag]; }
+        };
+
+        inline auto parse_path (source_cursor& in) -> std::vector<symbol> {
+            std::vector<symbol> path;
+            path.emplace_back(get_identifier(in));
+            while (in.peek() == '.') {
+                in.get();
+                path.emplace_back(get_identifier(in));
+            }
+
+            if (std::any_of(path.begin(), path.end(), [](auto&& seg) { return seg == symbol{}; })) {
+                throw render_error{};
+            }
+            return path;
+        }
+
+        /// A literal at the start of a tag argument, as found by `scan_literal`.
+        struct literal_token {
+            enum class kind { none, text, number, real };
+
+            kind type = kind::none;
+            std::string_view text; ///< The contents of a text literal, or all the digits of a real one.
+            number_t number = 0;
+        };
+
+        /// Scan the literal at `pos` in `text`, if there is one, and move `pos` past it. Templates compiled
+        /// at run time and static templates share this, so both accept the same text, whole and real literals.
+        /// \throws `koura::render_error` if a text literal isn't closed or a whole number doesn't fit in `number_t`.
+        constexpr auto scan_literal (std::string_view text, std::size_t& pos) -> literal_token {
+            auto is_digit = [](char c) { return c >= '0' && c <= '9'; };
+            auto at = [&](std::size_t i) { return i < text.size() ? text[i] : '\0'; };
+            literal_token token;
+
+            if (at(pos) == '\'') {
+                auto start = ++pos;
+                while (pos < text.size() && text[pos] != '\'') {
+                    ++pos;
+                }
+                if (pos == text.size()) {
+                    throw render_error{};
+                }
+                token.type = literal_token::kind::text;
+                token.text = text.substr(start, pos++ - start);
+            }
+            //Number literal, which is a real number if it has a fractional part
+            else if (is_digit(at(pos))) {
+                auto start = pos;
+                token.type = literal_token::kind::number;
+                while (is_digit(at(pos))) {
+                    auto digit = at(pos++) - '0';
+                    if (token.number > (std::numeric_limits<number_t>::max() - digit) / 10) {
+                        throw render_error{};
+                    }
+                    token.number = token.number * 10 + digit;
+                }
+
+                if (at(pos) == '.' && is_digit(at(pos + 1))) {
+                    ++pos;
+                    while (is_digit(at(pos))) {
+                        ++pos;
+                    }
+                    token.type = literal_token::kind::real;
+                    token.text = text.substr(start, pos - start);
+                }
+            }
+            return token;
+        }
+
+        inline auto to_entity (const literal_token& token) -> entity {
+            switch (token.type) {
+                case literal_token::kind::text:
+                    return entity{text_t{token.text}};
+                case literal_token::kind::real:
+                {
+                    real_t real = 0;
+                    std::from_chars(token.text.data(), token.text.data() + token.text.size(), real);
+                    return entity{real};
+                }
+                default:
+                    return entity{token.number};
+            }
+        }
+
+        inline auto parse_operand (source_cursor& in) -> operand {
+            eat_whitespace(in);
+            operand op;
+            auto pos = in.pos();
+            auto token = scan_literal(in.text(), pos);
+
+            if (token.type != literal_token::kind::none) {
+                in.seek(pos);
+                op.literal = to_entity(token);
+            }
+            //Named entity
+            else {
+                op.path = parse_path(in);
+            }
+
+            return op;
+        }
+
+        /// Parse a filter name, followed by `: ` and a whole number if it has an argument.
+        inline auto parse_filter (source_cursor& in) -> filter_call {
+            auto name = get_identifier(in);
+            if (name.empty()) {
+                throw render_error{};
+            }
+
+            filter_call call {name};
+            eat_whitespace(in);
+            if (in.peek() == ':') {
+                in.get();
+                eat_whitespace(in);
+                if (!std::isdigit(static_cast<unsigned char>(in.peek()))) {
+                    throw render_error{};
+                }
+                std::size_t arg = 0;
+                while (std::isdigit(static_cast<unsigned char>(in.peek()))) {
+                    std::size_t digit = in.get() - '0';
+                    if (arg > (std::numeric_limits<std::size_t>::max() - digit) / 10) {
+                        throw render_error{};
+                    }
+                    arg = arg * 10 + digit;
+                }
+                call.arg = arg;
+            }
+            return call;
+        }
+
+        /// Shared by the compilers of every template which is linked into one program.
+        struct link_state {
+            const template_loader* loader;
+            std::vector<std::shared_ptr<const void>> sources;
+            std::vector<std::string> stack;
+            const std::unordered_set<symbol>* custom_blocks = nullptr;
+        };
+
+        /// The bodies of `block`s by name, relative to the start of the body.
+        using block_map = std::unordered_map<symbol, compiled_program>;
+
+        /// Find the deepest nesting of `for` blocks in `program`.
+        inline auto max_loop_depth (const std::vector<instruction>& program) -> std::size_t {
+            std::size_t depth = 0, max_depth = 0;
+            for (auto&& instr : program) {
+                if (instr.op == opcode::loop) {
+                    max_depth = std::max(max_depth, ++depth);
+                }
+                else if (instr.op == opcode::end_loop) {
+                    --depth;
+                }
+            }
+            return max_depth;
+        }
+
+        /// Turns template text into a flat program of `instruction`s.
+        ///
+        /// Included templates are compiled in place, and a template which extends another is compiled by
+        /// compiling its parent with the child's blocks substituted in. Either way the result is a single
+        /// program which never refers back to the templates it was linked from.
+        class compiler {
+        public:
+            explicit compiler (std::string_view text, link_state* link = nullptr, block_map overrides = {}) :
+                m_in{text}, m_link{link}, m_exported{overrides}, m_overrides{std::move(overrides)}
+            {}
+
+            auto compile() -> compiled_program {
+                while (!m_in.done()) {
+                    compile_literal();
+                    if (m_in.done()) {
+                        break;
+                    }
+
+                    m_tag_start = m_in.pos();
+                    m_in.get();
+                    if (m_in.get() == '{') {
+                        compile_variable_tag();
+                    }
+                    else {
+                        compile_expression_tag();
+                    }
+                }
+
+                if (!m_blocks.empty()) {
+                    throw render_error{};
+                }
+
+                //Anything outside of a child template's blocks is ignored
+                if (!m_parent.empty()) {
+                    m_program = load(m_parent, std::move(m_exported));
+                }
+
+                m_max_loop_depth = detail::max_loop_depth(m_program.code);
+                return std::move(m_program);
+            }
+
+            /// The deepest nesting of `for` blocks in the compiled program.
+            auto max_loop_depth() const -> std::size_t { return m_max_loop_depth; }
+
+        private:
+            static constexpr auto npos = static_cast<std::size_t>(-1);
+
+            struct block {
+                std::string_view end_tag;
+                std::size_t start;
+                std::size_t pending_branch;
+                std::vector<std::size_t> exits {};
+                symbol name {};
+                std::size_t first_tag = 0;
+            };
+
+            /// Compile the template called `name` from the loader.
+            /// \throws `koura::render_error` if there's no loader or templates include each other.
+            auto load (const std::string& name, block_map overrides) -> compiled_program {
+                if (!m_link || !m_link->loader || !*m_link->loader ||
+                    std::find(m_link->stack.begin(), m_link->stack.end(), name) != m_link->stack.end()) {
+                    throw render_error{};
+                }
+
+                auto [source, text] = (*m_link->loader)(name);
+                m_link->sources.push_back(std::move(source));
+                m_link->stack.push_back(name);
+                compiler nested {text, m_link, std::move(overrides)};
+                auto code = nested.compile();
+                m_link->stack.pop_back();
+                return code;
+            }
+
+            static bool has_jump (const instruction& instr) {
+                return instr.op == opcode::branch || instr.op == opcode::jump ||
+                       instr.op == opcode::loop || instr.op == opcode::end_loop || instr.op == opcode::cache;
+            }
+
+            /// Append `code`, which was compiled starting at instruction 0, to the program.
+            void append (const compiled_program& code) {
+                auto offset = m_program.code.size();
+                auto tag_offset = m_program.tags.size();
+                for (auto instr : code.code) {
+                    if (has_jump(instr)) {
+                        instr.jump += offset;
+                    }
+                    if (instr.tag != instruction::no_tag) {
+                        instr.tag += tag_offset;
+                    }
+                    m_program.code.push_back(instr);
+                }
+                m_program.tags.insert(m_program.tags.end(), code.tags.begin(), code.tags.end());
+            }
+
+            auto parse_template_name() -> std::string {
+                auto op = parse_operand(m_in);
+                auto name = op.literal.get_if<text_t>();
+                if (!op.path.empty() || !name || name->empty()) {
+                    throw render_error{};
+                }
+                expect_tag_end(m_in);
+                return *name;
+            }
+
+            auto emit (instruction instr) -> std::size_t {
+                instr.source = m_in.slice(m_tag_start, m_in.pos());
+                instr.line = line_at(m_tag_start);
+                //The end of a tag can take the line break after it
+                if (instr.op != opcode::literal) {
+                    while (!instr.source.empty() && std::isspace(static_cast<unsigned char>(instr.source.back()))) {
+                        instr.source.remove_suffix(1);
+                    }
+                }
+                m_program.code.push_back(instr);
+                return m_program.code.size() - 1;
+            }
+
+            auto emit (instruction instr, tag_args args) -> std::size_t {
+                instr.tag = m_program.tags.size();
+                m_program.tags.push_back(std::move(args));
+                return emit(instr);
+            }
+
+            /// The line which `pos` is on. Positions must be asked about in order.
+            auto line_at (std::size_t pos) -> std::size_t {
+                auto skipped = m_in.slice(m_line_pos, pos);
+                m_line += std::count(skipped.begin(), skipped.end(), '\n');
+                m_line_pos = pos;
+                return m_line;
+            }
+
+            auto open_block (std::string_view end_tag) -> block& {
+                if (m_blocks.empty() || m_blocks.back().end_tag != end_tag) {
+                    throw render_error{};
+                }
+                return m_blocks.back();
+            }
+
+            void compile_literal() {
+                auto start = m_in.pos();
+                m_in.skip_to_tag();
+
+                if (m_in.pos() != start) {
+                    instruction instr{opcode::literal};
+                    instr.text = m_in.slice(start, m_in.pos());
+                    m_tag_start = start;
+                    emit(instr);
+                }
+            }
+
+            void compile_variable_tag() {
+                tag_args args;
+                args.arg.path = parse_path(m_in);
+                eat_whitespace(m_in);
+
+                while (m_in.peek() == '|') {
+                    m_in.get();
+                    args.filters.push_back(parse_filter(m_in));
+                    eat_whitespace(m_in);
+                }
+
+                expect(m_in, '}');
+                expect(m_in, '}');
+                emit(instruction{opcode::variable}, std::move(args));
+            }
+
+            void compile_expression_tag() {
+                auto name = get_identifier(m_in);
+
+                if (name == "if" || name == "unless") {
+                    auto branch = compile_branch(name == "unless");
+                    m_blocks.push_back({name == "if" ? "endif" : "endunless", branch, branch, {}});
+                }
+                else if (name == "elseif") {
+                    auto& blk = open_block("endif");
+                    if (blk.pending_branch == npos) {
+                        throw render_error{};
+                    }
+                    blk.exits.push_back(emit(instruction{opcode::jump}));
+                    m_program.code[blk.pending_branch].jump = m_program.code.size();
+                    blk.pending_branch = compile_branch(false);
+                }
+                else if (name == "else") {
+                    if (m_blocks.empty() || m_blocks.back().pending_branch == npos) {
+                        throw render_error{};
+                    }
+                    auto& blk = m_blocks.back();
+                    expect_tag_end(m_in);
+                    blk.exits.push_back(emit(instruction{opcode::jump}));
+                    m_program.code[blk.pending_branch].jump = m_program.code.size();
+                    blk.pending_branch = npos;
+                }
+                else if (name == "endif" || name == "endunless") {
+                    auto& blk = open_block(name);
+                    expect_tag_end(m_in);
+                    if (blk.pending_branch != npos) {
+                        m_program.code[blk.pending_branch].jump = m_program.code.size();
+                    }
+                    for (auto exit : blk.exits) {
+                        m_program.code[exit].jump = m_program.code.size();
+                    }
+                    m_blocks.pop_back();
+                }
+                else if (name == "for") {
+                    tag_args args;
+                    auto loop_var = get_identifier(m_in);
+                    if (loop_var.empty() || get_identifier(m_in) != "in") {
+                        throw render_error{};
+                    }
+                    args.name = loop_var;
+                    args.arg = parse_operand(m_in);
+                    if (args.arg.path.empty()) {
+                        throw render_error{};
+                    }
+                    expect_tag_end(m_in);
+
+                    m_blocks.push_back({"endfor", emit(instruction{opcode::loop}, std::move(args)), npos, {}});
+                }
+                else if (name == "endfor") {
+                    auto start = open_block("endfor").start;
+                    expect_tag_end(m_in);
+
+                    instruction instr{opcode::end_loop};
+                    instr.jump = start + 1;
+                    emit(instr);
+                    m_program.code[start].jump = m_program.code.size();
+
+                    m_blocks.pop_back();
+                }
+                else if (name == "cache") {
+                    tag_args args;
+                    args.arg = parse_operand(m_in);
+                    args.value.literal = entity{number_t{0}};
+                    auto option = get_identifier(m_in);
+                    if (option == "ttl") {
+                        args.value = parse_operand(m_in);
+                    }
+                    else if (!option.empty()) {
+                        throw render_error{};
+                    }
+                    expect_tag_end(m_in);
+
+                    m_blocks.push_back({"endcache", emit(instruction{opcode::cache}, std::move(args)), npos, {}});
+                }
+                else if (name == "endcache") {
+                    auto start = open_block("endcache").start;
+                    expect_tag_end(m_in);
+
+                    emit(instruction{opcode::end_cache});
+                    m_program.code[start].jump = m_program.code.size();
+                    m_blocks.pop_back();
+                }
+                else if (name == "include") {
+                    append(load(parse_template_name(), {}));
+                }
+                else if (name == "extends") {
+                    if (!m_parent.empty()) {
+                        throw render_error{};
+                    }
+                    m_parent = parse_template_name();
+                }
+                else if (name == "block") {
+                    auto block_name = get_identifier(m_in);
+                    if (block_name.empty()) {
+                        throw render_error{};
+                    }
+                    expect_tag_end(m_in);
+                    m_blocks.push_back({"endblock", m_program.code.size(), npos, {}, block_name, m_program.tags.size()});
+                }
+                else if (name == "endblock") {
+                    auto& blk = open_block("endblock");
+                    auto end_name = get_identifier(m_in);
+                    if (!end_name.empty() && symbol{end_name} != blk.name) {
+                        throw render_error{};
+                    }
+                    expect_tag_end(m_in);
+
+                    //The body is everything since the block started, so it can be swapped for an override
+                    auto start = blk.start;
+                    auto first_tag = blk.first_tag;
+                    auto body_name = blk.name;
+                    m_blocks.pop_back();
+
+                    auto override = m_overrides.find(body_name);
+                    if (override == m_overrides.end()) {
+                        compiled_program body;
+                        body.code.assign(m_program.code.begin() + start, m_program.code.end());
+                        body.tags.assign(std::make_move_iterator(m_program.tags.begin() + first_tag),
+                                         std::make_move_iterator(m_program.tags.end()));
+                        for (auto&& instr : body.code) {
+                            if (has_jump(instr)) {
+                                instr.jump -= start;
+                            }
+                            if (instr.tag != instruction::no_tag) {
+                                instr.tag -= first_tag;
+                            }
+                        }
+                        m_exported[body_name] = std::move(body);
+                    }
+
+                    m_program.code.resize(start);
+                    m_program.tags.resize(first_tag);
+                    append(m_exported[body_name]);
+                }
+                else if (name == "flush") {
+                    expect_tag_end(m_in);
+                    emit(instruction{opcode::flush});
+                }
+                else if (name == "set") {
+                    tag_args args;
+                    args.arg.path = parse_path(m_in);
+                    args.value = parse_operand(m_in);
+                    expect_tag_end(m_in);
+                    emit(instruction{opcode::set}, std::move(args));
+                }
+                else {
+                    if (name.empty()) {
+                        throw render_error{};
+                    }
+
+                    tag_args args;
+                    args.name = name;
+                    auto start = m_in.pos();
+                    skip_tag_end();
+
+                    //Custom block tags are given their whole body, which is left for them to render
+                    if (m_link && m_link->custom_blocks && m_link->custom_blocks->count(args.name)) {
+                        for (std::size_t depth = 1; depth > 0;) {
+                            m_in.skip_to_tag();
+                            if (m_in.done()) {
+                                throw render_error{};
+                            }
+                            m_in.get();
+                            if (m_in.get() == '%') {
+                                auto tag = get_identifier(m_in);
+                                if (tag == name) {
+                                    ++depth;
+                                }
+                                else if (tag.substr(0, 3) == "end" && tag.substr(3) == name) {
+                                    --depth;
+                                }
+                                skip_tag_end();
+                            }
+                        }
+                    }
+                    args.args = m_in.slice(start, m_in.pos());
+                    eat_single_trailing_whitespace(m_in);
+                    emit(instruction{opcode::custom}, std::move(args));
+                }
+            }
+
+            /// Skip past the next `%}`.
+            void skip_tag_end() {
+                while (!(m_in.peek() == '%' && m_in.peek(1) == '}')) {
+                    if (m_in.done()) {
+                        throw render_error{};
+                    }
+                    m_in.get();
+                }
+                m_in.get();
+                m_in.get();
+            }
+
+            auto compile_branch (bool negate) -> std::size_t {
+                instruction instr{opcode::branch};
+                instr.negate = negate;
+                tag_args args;
+                args.arg = parse_operand(m_in);
+                expect_tag_end(m_in);
+                return emit(instr, std::move(args));
+            }
+
+            source_cursor m_in;
+            compiled_program m_program;
+            std::vector<block> m_blocks;
+            std::size_t m_max_loop_depth = 0;
+            std::size_t m_tag_start = 0;
+            std::size_t m_line_pos = 0;
+            std::size_t m_line = 1;
+            link_state* m_link;
+            std::string m_parent;
+            block_map m_exported;
+            block_map m_overrides;
+        };
+
+        /// A run of path segments or filter calls in a `static_program`.
+        struct static_range {
+            std::size_t first = 0;
+            std::size_t size = 0;
+        };
+
+        /// A tag argument in a template parsed at compile time: a dotted path, or a literal if `path` is empty.
+        struct static_operand {
+            static_range path;
+            literal_token literal;
+        };
+
+        /// A filter in a variable tag parsed at compile time, like `filter_call` but with its name as text.
+        struct static_filter {
+            std::string_view name;
+            bool has_arg = false;
+            std::size_t arg = 0;
+        };
+
+        /// An instruction of a template parsed at compile time. Like `instruction`, but names are kept as
+        /// text, since symbols can only be interned at run time, so it can be built in a constant expression.
+        struct static_instruction {
+            opcode op = opcode::literal;
+            std::size_t jump = 0;
+            bool negate = false;
+            std::string_view text;
+            static_operand arg;
+            static_operand value;
+            std::string_view name;
+            static_range filters;
+        };
+
+        /// The instructions of a template parsed at compile time, with the segments of their paths and the
+        /// calls in their filter chains stored one after another.
+        template <std::size_t N, std::size_t Segments, std::size_t Filters>
+        struct static_program {
+            std::array<static_instruction, N> code {};
+            std::array<std::string_view, Segments> segments {};
+            std::array<static_filter, Filters> filters {};
+            std::size_t size = 0;
+            std::size_t segment_count = 0;
+            std::size_t filter_count = 0;
+        };
+
+        /// Parses template text in a constant expression, following the same grammar as `compiler`.
+        ///
+        /// Parsing stores at most `N` instructions, `Segments` path segments and `Filters` filter calls,
+        /// so the program is parsed once with no room to count them and then again to store them.
+        /// Malformed templates make the parse fail to be a constant expression, and the compiler's error
+        /// points at the call to `fail` with the reason.
+        template <std::size_t N, std::size_t Segments = 0, std::size_t Filters = 0>
+        class static_parser {
+        public:
+            constexpr explicit static_parser (std::string_view text) : m_text{text} {}
+
+            constexpr auto parse() -> static_program<N, Segments, Filters> {
+                while (m_pos < m_text.size()) {
+                    auto start = m_pos;
+                    skip_to_tag();
+                    if (m_pos != start) {
+                        static_instruction instr;
+                        instr.text = m_text.substr(start, m_pos - start);
+                        emit(instr);
+                    }
+                    if (m_pos == m_text.size()) {
+                        break;
+                    }
+
+                    m_pos += 2;
+                    if (m_text[m_pos - 1] == '{') {
+                        variable_tag();
+                    }
+                    else {
+                        expression_tag();
+                    }
+                }
+
+                if (m_depth != 0) {
+                    fail("a block tag is never closed");
+                }
+                return m_result;
+            }
+
+        private:
+            static constexpr auto npos = static_cast<std::size_t>(-1);
+            static constexpr std::size_t max_depth = 64;
+
+            struct block {
+                std::string_view end_tag;
+                std::size_t start = 0;
+                std::size_t pending_branch = 0;
+                std::size_t last_exit = 0;
+            };
+
+            [[noreturn]] static void fail (const char* reason) {
+                (void)reason;
+                throw render_error{};
+            }
+
+            static constexpr bool is_space (char c) {
+                return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+            }
+            static constexpr bool is_identifier_char (char c) {
+                return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+            }
+            static constexpr bool is_digit (char c) { return c >= '0' && c <= '9'; }
+
+            constexpr char peek() const { return m_pos < m_text.size() ? m_text[m_pos] : '\0'; }
+            constexpr char get() { return m_pos < m_text.size() ? m_text[m_pos++] : '\0'; }
+
+            constexpr void skip_to_tag() {
+                while (m_pos < m_text.size() &&
+                       !(m_text[m_pos] == '{' && m_pos + 1 < m_text.size() &&
+                         (m_text[m_pos + 1] == '{' || m_text[m_pos + 1] == '%'))) {
+                    ++m_pos;
+                }
+            }
+
+            constexpr void eat_whitespace() {
+                while (is_space(peek())) {
+                    ++m_pos;
+                }
+            }
+
+            constexpr auto identifier() -> std::string_view {
+                eat_whitespace();
+                auto start = m_pos;
+                while (is_identifier_char(peek())) {
+                    ++m_pos;
+                }
+                return m_text.substr(start, m_pos - start);
+            }
+
+            constexpr void expect (char c) {
+                if (get() != c) {
+                    fail("unexpected character in a tag");
+                }
+            }
+
+            constexpr void expect_tag_end() {
+                eat_whitespace();
+                expect('%');
+                expect('}');
+                if (peek() == '\n') {
+                    ++m_pos;
+                }
+            }
+
+            constexpr auto path() -> static_range {
+                static_range range {m_result.segment_count, 0};
+                while (true) {
+                    auto segment = identifier();
+                    if (segment.empty()) {
+                        fail("expected a name");
+                    }
+                    if (m_result.segment_count < Segments) {
+                        m_result.segments[m_result.segment_count] = segment;
+                    }
+                    ++m_result.segment_count;
+                    ++range.size;
+                    if (peek() != '.') {
+                        return range;
+                    }
+                    ++m_pos;
+                }
+            }
+
+            constexpr auto filter() -> static_filter {
+                static_filter call;
+                call.name = identifier();
+                if (call.name.empty()) {
+                    fail("expected a filter name");
+                }
+                eat_whitespace();
+                if (peek() == ':') {
+                    ++m_pos;
+                    eat_whitespace();
+                    if (!is_digit(peek())) {
+                        fail("expected a whole number as the filter's argument");
+                    }
+                    call.has_arg = true;
+                    while (is_digit(peek())) {
+                        std::size_t digit = get() - '0';
+                        if (call.arg > (static_cast<std::size_t>(-1) - digit) / 10) {
+                            fail("the filter's argument is too large");
+                        }
+                        call.arg = call.arg * 10 + digit;
+                    }
+                    eat_whitespace();
+                }
+                return call;
+            }
+
+            constexpr auto operand() -> static_operand {
+                eat_whitespace();
+                static_operand op;
+                op.literal = scan_literal(m_text, m_pos);
+                if (op.literal.type == literal_token::kind::none) {
+                    op.path = path();
+                }
+                return op;
+            }
+
+            constexpr auto emit (const static_instruction& instr) -> std::size_t {
+                if (m_result.size < N) {
+                    m_result.code[m_result.size] = instr;
+                }
+                return m_result.size++;
+            }
+
+            //Jumps are only stored on the second pass, when there's room for every instruction
+            constexpr void patch (std::size_t at, std::size_t target) {
+                if (at < N) {
+                    m_result.code[at].jump = target;
+                }
+            }
+
+            constexpr auto open_block (std::string_view end_tag) -> block& {
+                if (m_depth == 0 || m_blocks[m_depth - 1].end_tag != end_tag) {
+                    fail("block tags are unbalanced");
+                }
+                return m_blocks[m_depth - 1];
+            }
+
+            constexpr void push_block (block blk) {
+                if (m_depth == max_depth) {
+                    fail("blocks are nested too deeply");
+                }
+                m_blocks[m_depth++] = blk;
+            }
+
+            constexpr void variable_tag() {
+                static_instruction instr;
+                instr.op = opcode::variable;
+                instr.arg.path = path();
+                eat_whitespace();
+
+                instr.filters.first = m_result.filter_count;
+                while (peek() == '|') {
+                    ++m_pos;
+                    auto call = filter();
+                    if (m_result.filter_count < Filters) {
+                        m_result.filters[m_result.filter_count] = call;
+                    }
+                    ++m_result.filter_count;
+                    ++instr.filters.size;
+                }
+
+                expect('}');
+                expect('}');
+                emit(instr);
+            }
+
+            constexpr auto branch (bool negate) -> std::size_t {
+                static_instruction instr;
+                instr.op = opcode::branch;
+                instr.negate = negate;
+                instr.arg = operand();
+                expect_tag_end();
+                return emit(instr);
+            }
+
+            //The exits of an `if` chain are linked through their jump targets until `endif` patches them
+            constexpr void add_exit (block& blk) {
+                static_instruction instr;
+                instr.op = opcode::jump;
+                instr.jump = blk.last_exit;
+                blk.last_exit = emit(instr);
+                patch(blk.pending_branch, m_result.size);
+            }
+
+            constexpr void expression_tag() {
+                auto name = identifier();
+
+                if (name == "if" || name == "unless") {
+                    auto start = branch(name == "unless");
+                    push_block({name == "if" ? "endif" : "endunless", start, start, npos});
+                }
+                else if (name == "elseif") {
+                    auto& blk = open_block("endif");
+                    if (blk.pending_branch == npos) {
+                        fail("elseif after else");
+                    }
+                    add_exit(blk);
+                    blk.pending_branch = branch(false);
+                }
+                else if (name == "else") {
+                    if (m_depth == 0 || m_blocks[m_depth - 1].pending_branch == npos) {
+                        fail("else outside of an if");
+                    }
+                    expect_tag_end();
+                    auto& blk = m_blocks[m_depth - 1];
+                    add_exit(blk);
+                    blk.pending_branch = npos;
+                }
+                else if (name == "endif" || name == "endunless") {
+                    auto& blk = open_block(name);
+                    expect_tag_end();
+                    if (blk.pending_branch != npos) {
+                        patch(blk.pending_branch, m_result.size);
+                    }
+                    if (N != 0) {
+                        for (auto exit = blk.last_exit; exit != npos;) {
+                            auto next = m_result.code[exit].jump;
+                            patch(exit, m_result.size);
+                            exit = next;
+                        }
+                    }
+                    --m_depth;
+                }
+                else if (name == "for") {
+                    static_instruction instr;
+                    instr.op = opcode::loop;
+                    instr.name = identifier();
+                    if (instr.name.empty() || identifier() != "in") {
+                        fail("expected for <name> in <sequence>");
+                    }
+                    instr.arg = operand();
+                    if (instr.arg.path.size == 0) {
+                        fail("for loops need a sequence to loop over");
+                    }
+                    expect_tag_end();
+                    push_block({"endfor", emit(instr), npos, npos});
+                }
+                else if (name == "endfor") {
+                    auto start = open_block("endfor").start;
+                    expect_tag_end();
+
+                    static_instruction instr;
+                    instr.op = opcode::end_loop;
+                    instr.jump = start + 1;
+                    emit(instr);
+                    patch(start, m_result.size);
+                    --m_depth;
+                }
+                else if (name == "flush") {
+                    expect_tag_end();
+                    static_instruction instr;
+                    instr.op = opcode::flush;
+                    emit(instr);
+                }
+                else if (name == "set") {
+                    static_instruction instr;
+                    instr.op = opcode::set;
+                    instr.arg.path = path();
+                    instr.value = operand();
+                    expect_tag_end();
+                    emit(instr);
+                }
+                else {
+                    fail("static templates only support variables, if, unless, for, set and flush");
+                }
+            }
+
+            std::string_view m_text;
+            std::size_t m_pos = 0;
+            static_program<N, Segments, Filters> m_result {};
+            std::array<block, max_depth> m_blocks {};
+            std::size_t m_depth = 0;
+        };
+
+        /// Builds the run-time form of the arguments of a tag parsed at compile time,
+        /// which only has to intern its names.
+        template <class Program>
+        auto to_tag_args (const Program& program, const static_instruction& from) -> tag_args {
+            auto to_operand = [&](const static_operand& op) {
+                operand result;
+                if (op.path.size != 0) {
+                    result.path.reserve(op.path.size);
+                    for (auto i = op.path.first; i < op.path.first + op.path.size; ++i) {
+                        result.path.emplace_back(program.segments[i]);
+                    }
+                }
+                else {
+                    result.literal = to_entity(op.literal);
+                }
+                return result;
+            };
+
+            tag_args args;
+            args.arg = to_operand(from.arg);
+            args.value = to_operand(from.value);
+            args.name = from.name;
+
+            args.filters.reserve(from.filters.size);
+            for (auto i = from.filters.first; i < from.filters.first + from.filters.size; ++i) {
+                auto& call = program.filters[i];
+                args.filters.push_back({symbol{call.name}, call.has_arg ? std::optional{call.arg} : std::nullopt});
+            }
+            return args;
+        }
+
+        /// Reads the rest of `in` in bulk straight from its stream buffer.
+        inline auto read_all (std::istream& in) -> std::string {
+            std::string text;
+            std::istream::sentry sentry {in, true};
+            if (!sentry) {
+                return text;
+            }
+
+            char buffer[4096];
+            while (true) {
+                auto got = in.rdbuf()->sgetn(buffer, sizeof(buffer));
+                text.append(buffer, static_cast<std::size_t>(got));
+                if (got < static_cast<std::streamsize>(sizeof(buffer))) {
+                    in.setstate(std::ios_base::eofbit);
+                    return text;
+                }
+            }
+        }
+
+        /// Maps the file at `path` into memory, returning a handle which keeps it mapped and a view of its contents.
+        /// Falls back to reading the file where `mmap` isn't available.
+        /// \throws `std::system_error` if the file can't be read.
+        inline auto map_file (const std::filesystem::path& path) -> std::pair<std::shared_ptr<const void>, std::string_view> {
+#if KOURA_HAS_MMAP
+            auto fail = [&path] { throw std::system_error{errno, std::generic_category(), "Couldn't map " + path.string()}; };
+
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                fail();
+            }
+
+            struct stat info;
+            if (::fstat(fd, &info) < 0) {
+                ::close(fd);
+                fail();
+            }
+
+            auto size = static_cast<std::size_t>(info.st_size);
+            if (size == 0) {
+                ::close(fd);
+                return {nullptr, {}};
+            }
+
+            auto addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (addr == MAP_FAILED) {
+                fail();
+            }
+
+            std::shared_ptr<const void> mapping {addr, [size](const void* p) { ::munmap(const_cast<void*>(p), size); }};
+            return {std::move(mapping), {static_cast<const char*>(addr), size}};
+#else
+            std::ifstream in {path, std::ios::binary};
+            if (!in) {
+                throw std::system_error{std::make_error_code(std::errc::no_such_file_or_directory),
+                                        "Couldn't open " + path.string()};
+            }
+
+            auto text = std::make_shared<const std::string>(read_all(in));
+            return {text, *text};
+#endif
+        }
+
+        /// A read-only stream buffer over existing text, which it doesn't copy.
+        class view_streambuf : public std::streambuf {
+        public:
+            explicit view_streambuf (std::string_view text) {
+                auto begin = const_cast<char*>(text.data());
+                setg(begin, begin, begin + text.size());
+            }
+        };
+
+        /// Writes `text` to `out` with a single call to its stream buffer.
+        inline void write_text (std::ostream& out, std::string_view text) {
+            auto size = static_cast<std::streamsize>(text.size());
+            if (out.rdbuf()->sputn(text.data(), size) != size) {
+                out.setstate(std::ios_base::badbit);
+            }
+        }
+
+        /// Thrown when a render reaches a deferred entity whose value isn't available yet.
+        /// It never escapes the engine, which stops the render and remembers what it's waiting for.
+        struct suspension {
+            deferred pending;
+        };
+
+        /// Get the value of `ent`, looking through it if it's deferred.
+        /// \throws `suspension` if the value isn't available yet.
+        inline entity& await_value (entity& ent) {
+            auto value = ent.get_if<deferred>();
+            if (!value) {
+                return ent;
+            }
+            if (!value->ready()) {
+                throw suspension{*value};
+            }
+            //The shared state owns a mutable entity, the future just doesn't hand out mutable references
+            return const_cast<entity&>(value->get());
+        }
+
+        /// Looks up the entity at the end of a dotted path.
+        /// Fields of bound objects are read into `scratch`, which the result may refer to.
+        /// \throws `std::out_of_range` if the first segment isn't in the context,
+        /// `koura::render_error` if a later one can't be found and `suspension` if the path
+        /// passes through a deferred entity which isn't available yet.
+        inline entity& resolve_path (const std::vector<symbol>& path, context& ctx, entity& scratch) {
+            auto* ent = &await_value(ctx.get_entity(path.front()));
+
+            for (auto it = std::next(path.begin()); it != path.end(); ++it) {
+                if (ent->get_type() != entity::type::object) {
+                    throw render_error{};
+                }
+
+                if (ent->is_bound()) {
+                    auto& ref = ent->get_bound();
+                    scratch = ref.binding->field(ref.object, *it);
+                    ent = &scratch;
+                    continue;
+                }
+
+                auto& obj = ent->get_value<object_t>();
+                auto field = obj.find(*it);
+                if (field == obj.end()) {
+                    throw render_error{};
+                }
+                ent = &await_value(field->second);
+            }
+
+            return *ent;
+        }
+
+        inline const entity& evaluate (const operand& op, context& ctx, entity& scratch) {
+            return op.path.empty() ? op.literal : resolve_path(op.path, ctx, scratch);
+        }
+
+        /// Add the paths which a tag with `args` reads to `reads`, unless they're already there.
+        inline void record_reads (const tag_args& args, std::vector<const std::vector<symbol>*>& reads) {
+            for (auto path : {&args.arg.path, &args.value.path}) {
+                if (!path->empty() && std::find(reads.begin(), reads.end(), path) == reads.end()) {
+                    reads.push_back(path);
+                }
+            }
+        }
+
+        /// Return whether a change to the entity at `changed` can affect a read of `read`,
+        /// which is when one of the paths leads into the other.
+        inline bool paths_overlap (const std::vector<symbol>& changed, const std::vector<symbol>& read) {
+            auto n = std::min(changed.size(), read.size());
+            return std::equal(changed.begin(), changed.begin() + n, read.begin());
+        }
+
+        /// Return whether a loop in `ctx` or one of the scopes around it is iterating over a sequence which
+        /// a change to `path` would replace.
+        inline bool loops_over (const context& ctx, const std::vector<symbol>& path) {
+            for (auto scope = &ctx; scope; scope = scope->m_parent) {
+                auto iterating = scope->m_iterating;
+                if (iterating && !iterating->empty() && paths_overlap(path, *iterating)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /// Run a `set` instruction, assigning its value to its target.
+        /// Entities which the context doesn't own, such as loop variables bound to the elements of a
+        /// sequence, are the caller's data, so they can't be set. Neither can sequences which a loop is
+        /// iterating over, since the loop refers to their elements.
+        /// \throws `koura::render_error` if the target is bound or being iterated over,
+        /// or the value has a different type.
+        inline void assign (const tag_args& args, context& ctx) {
+            if (ctx.is_bound(args.arg.path.front()) || loops_over(ctx, args.arg.path)) {
+                throw render_error{};
+            }
+            entity scratch, val_scratch;
+            auto& ent = resolve_path(args.arg.path, ctx, scratch);
+            auto& val = evaluate(args.value, ctx, val_scratch);
+            if (ent.is_bound() || ent.get_type() != val.get_type()) {
+                throw render_error{};
+            }
+            ent = val;
+        }
+
+        inline bool evaluate_condition (const operand& op, context& ctx) {
+            if (!op.path.empty() && !ctx.contains(op.path.front())) {
+                return false;
+            }
+
+            entity scratch;
+            return is_truthy(evaluate(op, ctx, scratch));
+        }
+
+        /// The state of a `for` loop which is being rendered.
+        /// The loop variable lives in a child scope of the enclosing one and is rebound to each
+        /// element in turn, so iterations neither copy the context nor the sequence.
+        struct loop_frame {
+            loop_frame (symbol loop_var, const std::vector<symbol>& path, entity& sequence, context& outer,
+                        std::pmr::memory_resource* arena) :
+                loop_var{loop_var}, outer{&outer}, scope{outer.new_scope(arena)}
+            {
+                scope.m_iterating = &path;
+                if (auto elements = sequence.get_if<sequence_t>()) {
+                    this->elements = elements;
+                    size = elements->size();
+                    return;
+                }
+
+                //Bound sequences may have been read into a scratch entity, so keep our own copy of the reference
+                source = sequence;
+                if (source.is_bound()) {
+                    size = source.get_bound().binding->size(source.get_bound().object);
+                }
+            }
+
+            /// Bind the loop variable to the next element, returning `false` if there are no more.
+            bool next() {
+                if (auto gen = source.get_if<generator>()) {
+                    if (!gen->next(element)) {
+                        return false;
+                    }
+                    scope.bind_entity(loop_var, element);
+                    return true;
+                }
+
+                if (index == size) {
+                    return false;
+                }
+
+                if (elements) {
+                    scope.bind_entity(loop_var, (*elements)[index]);
+                }
+                else {
+                    auto& ref = source.get_bound();
+                    element = ref.binding->element(ref.object, index);
+                    scope.bind_entity(loop_var, element);
+                }
+                ++index;
+                return true;
+            }
+
+            symbol loop_var;
+            sequence_t* elements = nullptr;
+            entity source;
+            entity element;
+            std::size_t index = 0;
+            std::size_t size = 0;
+            context* outer;
+            context scope;
+        };
+
+        /// A range of top-level instructions [`begin`, `end`) which can be rendered on its own.
+        /// Parallel regions don't change the context or write to the output stream other than by
+        /// rendering text, so they can be rendered at the same time as their parallel neighbours.
+        struct region {
+            std::size_t begin;
+            std::size_t end;
+            bool parallel;
+        };
+
+        /// Find the end of the top-level tag starting at `begin`, which is past the end of the whole block
+        /// for `for`, `cache` and `if` tags.
+        inline auto top_level_end (const std::vector<instruction>& program, std::size_t begin) -> std::size_t {
+            //Jumps out of a block only go forwards, so the block ends after its furthest jump target
+            auto end = begin + 1;
+            for (auto pc = begin; pc < end; ++pc) {
+                auto op = program[pc].op;
+                if (op == opcode::branch || op == opcode::jump || op == opcode::loop || op == opcode::cache) {
+                    end = std::max(end, program[pc].jump);
+                }
+            }
+            return end;
+        }
+
+        /// Splits a program into top-level regions. Each `for`, `cache` block and `if` chain gets a region of
+        /// its own, while runs of plain text and variables are kept together.
+        inline auto find_regions (const std::vector<instruction>& program) -> std::vector<region> {
+            std::vector<region> regions;
+
+            for (std::size_t begin = 0; begin < program.size();) {
+                auto end = top_level_end(program, begin);
+                bool block = end > begin + 1;
+                bool parallel = std::none_of(program.begin() + begin, program.begin() + end, [](auto& instr) {
+                    return instr.op == opcode::set || instr.op == opcode::flush || instr.op == opcode::custom;
+                });
+
+                if (!block && parallel && !regions.empty() && regions.back().parallel &&
+                    program[regions.back().begin].op != opcode::loop && program[regions.back().begin].op != opcode::branch &&
+                    program[regions.back().begin].op != opcode::cache) {
+                    regions.back().end = end;
+                }
+                else {
+                    regions.push_back({begin, end, parallel});
+                }
+                begin = end;
+            }
+
+            return regions;
+        }
+
+        /// A stream buffer which appends everything written to it to a string.
+        class string_writer : public std::streambuf {
+        public:
+            explicit string_writer (std::string& target) : m_target{&target} {}
+
+        protected:
+            int_type overflow (int_type ch) override {
+                if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+                    m_target->push_back(traits_type::to_char_type(ch));
+                }
+                return traits_type::not_eof(ch);
+            }
+
+            std::streamsize xsputn (const char* text, std::streamsize count) override {
+                m_target->append(text, static_cast<std::size_t>(count));
+                return count;
+            }
+
+        private:
+            std::string* m_target;
+        };
+
+        /// The text of a `cache` block which is being rendered, to be stored once the block ends.
+        struct fragment_capture {
+            fragment_capture (std::size_t instruction, entity::type type, std::string_view key,
+                              std::chrono::steady_clock::duration ttl, std::ostream* outer) :
+                instruction{instruction}, type{type}, key{key}, ttl{ttl}, outer{outer}
+            {}
+
+            std::size_t instruction;
+            entity::type type;
+            std::string key;
+            std::chrono::steady_clock::duration ttl;
+            std::ostream* outer;
+            std::string text;
+            string_writer buf {text};
+            std::ostream out {&buf};
+        };
+
+        /// Turns variable instructions into text at compile time, returning `false` if it can't.
+        using variable_folder = std::function<bool(const tag_args&, context&, std::string&)>;
+
+        /// Specialises `source` for `constants`, entities whose values are known when it's compiled.
+        ///
+        /// Lookups of constants are folded into literal text by `fold_variable`, branches on them are decided,
+        /// and top-level `set` tags which give them literal values are applied straight away. Code which can
+        /// no longer be reached is removed and neighbouring literal spans are joined. New text is stored in
+        /// `text`, which the returned program's literal spans point into.
+        inline auto fold_constants (const compiled_program& source, context& constants,
+                                    const variable_folder& fold_variable, std::deque<std::string>& text)
+            -> compiled_program {
+            auto& program = source.code;
+            auto n = program.size();
+            auto has_jump = [](const instruction& instr) {
+                return instr.op == opcode::branch || instr.op == opcode::jump ||
+                       instr.op == opcode::loop || instr.op == opcode::end_loop || instr.op == opcode::cache;
+            };
+
+            //A `set` can only be folded into later reads if it runs exactly once, before anything after it
+            std::vector<bool> top_level (n, false);
+            for (std::size_t begin = 0; begin < n;) {
+                auto end = top_level_end(program, begin);
+                top_level[begin] = end == begin + 1;
+                begin = end;
+            }
+
+            auto foldable_set = [&](std::size_t pc) {
+                auto& args = source.args_of(program[pc]);
+                if (!top_level[pc] || args.arg.path.size() != 1 || !args.value.path.empty() ||
+                    !constants.contains(args.arg.path.front())) {
+                    return false;
+                }
+                auto& target = constants.get_entity(args.arg.path.front());
+                return !constants.is_bound(args.arg.path.front()) && !target.is_bound() &&
+                       target.get_type() == args.value.literal.get_type();
+            };
+
+            //Constants changed by a `set` which can't be applied now could have any value at render time
+            std::vector<symbol> changing;
+            for (std::size_t pc = 0; pc < n; ++pc) {
+                if (program[pc].op == opcode::set && !foldable_set(pc)) {
+                    changing.push_back(source.args_of(program[pc]).arg.path.front());
+                }
+            }
+
+            auto folded = constants.new_scope();
+            std::vector<symbol> loop_vars;
+            auto is_constant = [&](const operand& op) {
+                if (op.path.empty()) {
+                    return true;
+                }
+                auto name = op.path.front();
+                return folded.contains(name) &&
+                       std::find(changing.begin(), changing.end(), name) == changing.end() &&
+                       std::find(loop_vars.begin(), loop_vars.end(), name) == loop_vars.end();
+            };
+
+            auto optimised = program;
+            std::vector<bool> removed (n, false);
+            for (std::size_t pc = 0; pc < n; ++pc) {
+                auto& instr = optimised[pc];
+                switch (instr.op) {
+                case opcode::loop:
+                    loop_vars.push_back(source.args_of(instr).name);
+                    break;
+
+                case opcode::end_loop:
+                    loop_vars.pop_back();
+                    break;
+
+                case opcode::variable:
+                {
+                    std::string value;
+                    auto& args = source.args_of(instr);
+                    if (is_constant(args.arg) && fold_variable(args, folded, value)) {
+                        text.push_back(std::move(value));
+                        instr.op = opcode::literal;
+                        instr.text = text.back();
+                    }
+                    break;
+                }
+
+                case opcode::branch:
+                    if (is_constant(source.args_of(instr).arg)) {
+                        //Lookups which fail are left for the render to report
+                        try {
+                            if (evaluate_condition(source.args_of(instr).arg, folded) != instr.negate) {
+                                removed[pc] = true;
+                            }
+                            else {
+                                instr.op = opcode::jump;
+                            }
+                        }
+                        catch (render_error&) {}
+                        catch (suspension&) {}
+                    }
+                    break;
+
+                case opcode::set:
+                    //The `set` itself still runs, so custom tags, unfolded reads and the caller see the new value
+                    if (foldable_set(pc) && is_constant(source.args_of(instr).arg)) {
+                        auto& args = source.args_of(instr);
+                        folded.add_entity(args.arg.path.front(), args.value.literal);
+                    }
+                    break;
+
+                default:
+                    break;
+                }
+            }
+
+            //Follow every path through the program, so code behind decided branches is dropped
+            std::vector<bool> reachable (n, false);
+            std::vector<std::size_t> pending {0};
+            while (!pending.empty()) {
+                auto pc = pending.back();
+                pending.pop_back();
+                if (pc >= n || reachable[pc]) {
+                    continue;
+                }
+                reachable[pc] = true;
+
+                auto& instr = optimised[pc];
+                if (instr.op != opcode::jump || removed[pc]) {
+                    pending.push_back(pc + 1);
+                }
+                if (has_jump(instr) && !removed[pc]) {
+                    pending.push_back(instr.jump);
+                }
+            }
+
+            //Forward jumps always point past themselves, so working backwards also drops jumps to the next instruction
+            std::vector<std::size_t> next_kept (n + 1, n);
+            for (auto pc = n; pc-- > 0;) {
+                auto& instr = optimised[pc];
+                bool keep = reachable[pc] && !removed[pc] &&
+                            !(instr.op == opcode::jump && next_kept[instr.jump] == next_kept[pc + 1]);
+                next_kept[pc] = keep ? pc : next_kept[pc + 1];
+            }
+
+            std::vector<bool> is_target (n + 1, false);
+            for (std::size_t pc = 0; pc < n; ++pc) {
+                if (next_kept[pc] == pc && has_jump(optimised[pc])) {
+                    is_target[next_kept[optimised[pc].jump]] = true;
+                }
+            }
+
+            //Join runs of literal spans which nothing jumps into the middle of
+            std::vector<std::size_t> new_index (n + 1, 0);
+            std::vector<instruction> result;
+            std::string joined;
+            std::size_t run_start = n;
+            auto finish_run = [&] {
+                if (run_start != n && joined.size() != result.back().text.size()) {
+                    text.push_back(std::move(joined));
+                    result.back().text = text.back();
+                }
+                joined.clear();
+                run_start = n;
+            };
+
+            for (std::size_t pc = 0; pc < n; ++pc) {
+                if (next_kept[pc] != pc) {
+                    continue;
+                }
+
+                auto& instr = optimised[pc];
+                if (instr.op == opcode::literal && run_start != n && !is_target[pc]) {
+                    joined += instr.text;
+                    continue;
+                }
+
+                finish_run();
+                if (instr.op == opcode::literal) {
+                    run_start = pc;
+                    joined = instr.text;
+                }
+                new_index[pc] = result.size();
+                result.push_back(std::move(instr));
+            }
+            finish_run();
+            new_index[n] = result.size();
+
+            for (auto&& instr : result) {
+                if (has_jump(instr)) {
+                    instr.jump = new_index[next_kept[instr.jump]];
+                }
+            }
+
+            //Tags which were folded away keep their arguments, which nothing refers to any more
+            return {std::move(result), source.tags};
+        }
+    }
+
+    /// An output buffer which hands rendered text to a callback in large chunks.
+    ///
+    /// Text is collected in a fixed-size buffer, and the callback is given the buffered text whenever
+    /// the buffer fills up, whenever a template reaches a `{% flush %}` tag and at the end of a render.
+    /// This lets callers stream a page to a socket while the rest of it is still rendering.
+    /// The sink is a stream buffer, so it can also be written to through a `std::ostream`.
+    class output_sink : public std::streambuf {
+    public:
+        /// The type of the callback which receives chunks of rendered text.
+        using chunk_handler_t = std::function<void(std::string_view)>;
+
+        /// Create a sink which passes chunks of at most `capacity` bytes to `on_chunk`.
+        explicit output_sink (chunk_handler_t on_chunk, std::size_t capacity = 16 * 1024) :
+            m_on_chunk{std::move(on_chunk)}, m_buffer(std::max<std::size_t>(capacity, 1))
+        {
+            reset();
+        }
+
+        output_sink (const output_sink&) = delete;
+        output_sink& operator= (const output_sink&) = delete;
+
+        /// Hand any buffered text to the callback.
+        void flush() {
+            auto size = static_cast<std::size_t>(pptr() - pbase());
+            reset();
+            if (size) {
+                m_on_chunk({m_buffer.data(), size});
+            }
+        }
+
+    protected:
+        auto overflow (int_type c) -> int_type override {
+            flush();
+            if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                *pptr() = traits_type::to_char_type(c);
+                pbump(1);
+            }
+            return traits_type::not_eof(c);
+        }
+
+        auto xsputn (const char* s, std::streamsize n) -> std::streamsize override {
+            auto count = static_cast<std::size_t>(n);
+            auto space = static_cast<std::size_t>(epptr() - pptr());
+
+            if (count <= space) {
+                std::memcpy(pptr(), s, count);
+                pbump(static_cast<int>(count));
+                return n;
+            }
+
+            //Text which is at least a whole buffer long is handed over directly rather than copied
+            flush();
+            if (count >= m_buffer.size()) {
+                m_on_chunk({s, count});
+            }
+            else {
+                std::memcpy(pptr(), s, count);
+                pbump(static_cast<int>(count));
+            }
+            return n;
+        }
+
+        int sync() override {
+            flush();
+            return 0;
+        }
+
+    private:
+        void reset() {
+            setp(m_buffer.data(), m_buffer.data() + m_buffer.size());
+        }
+
+        chunk_handler_t m_on_chunk;
+        std::vector<char> m_buffer;
+    };
+
+    /// A fixed set of worker threads which run jobs in the order they are submitted.
+    /// Renders can use a pool to render independent parts of a template at once, see `render_options::pool`.
+    class thread_pool {
+    public:
+        /// Start `threads` worker threads.
+        explicit thread_pool (std::size_t threads = std::max(1u, std::thread::hardware_concurrency())) {
+            m_workers.reserve(threads);
+            for (std::size_t i = 0; i < threads; ++i) {
+                m_workers.emplace_back([this] { work(); });
+            }
+        }
+
+        thread_pool (const thread_pool&) = delete;
+        thread_pool& operator= (const thread_pool&) = delete;
+
+        /// Finish the jobs which have already been submitted, then stop the workers.
+        ~thread_pool() {
+            {
+                std::lock_guard lock {m_mutex};
+                m_stopping = true;
+            }
+            m_wake.notify_all();
+            for (auto&& worker : m_workers) {
+                worker.join();
+            }
+        }
+
+        /// Get the number of worker threads.
+        auto size() const -> std::size_t { return m_workers.size(); }
+
+        /// Queue `job` to be run by one of the workers.
+        void submit (std::function<void()> job) {
+            {
+                std::lock_guard lock {m_mutex};
+                m_jobs.push_back(std::move(job));
+            }
+            m_wake.notify_one();
+        }
+
+    private:
+        void work() {
+            while (true) {
+                std::function<void()> job;
+                {
+                    std::unique_lock lock {m_mutex};
+                    m_wake.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+                    if (m_jobs.empty()) {
+                        return;
+                    }
+                    job = std::move(m_jobs.front());
+                    m_jobs.pop_front();
+                }
+                job();
+            }
+        }
+
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        std::deque<std::function<void()>> m_jobs;
+        bool m_stopping = false;
+        std::vector<std::thread> m_workers;
+    };
+
+    /// A bounded store of the text rendered by `cache` blocks, shared by the renders given it in
+    /// `render_options::cache`.
+    ///
+    /// `{% cache key %}...{% endcache %}` renders its body once and stores the text under the value of `key`,
+    /// which must be text, a number, a real number or a boolean. Later renders write the stored text instead
+    /// of rendering the body, until the entry is invalidated or evicted. `{% cache key ttl seconds %}` also
+    /// makes the entry expire after that many seconds. Once `capacity` entries are stored, storing another
+    /// evicts the least recently used one.
+    /// Each block has its own entries, so blocks in different places or different templates never see each
+    /// other's text, and keys of different types are different keys, so `'7'` and `7` don't share an entry.
+    /// A cache can be used by any number of renders at once.
+    class fragment_cache {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        /// Identifies a `cache` block: the template it's in and the index of its instruction.
+        /// Every compiled template has its own identity, which its copies share.
+        struct block_id {
+            std::uint64_t tmpl = 0;
+            std::size_t instruction = 0;
+
+            friend bool operator== (const block_id& lhs, const block_id& rhs) {
+                return lhs.tmpl == rhs.tmpl && lhs.instruction == rhs.instruction;
+            }
+        };
+
+        explicit fragment_cache (std::size_t capacity = 1024) : m_capacity{capacity} {}
+        fragment_cache (const fragment_cache&) = delete;
+        fragment_cache& operator= (const fragment_cache&) = delete;
+
+        /// Get the text stored for `block` under `key`, or null if there isn't any or it has expired.
+        /// \throws `koura::render_error` if `key` is an object or sequence.
+        auto find (block_id block, const entity& key) -> std::shared_ptr<const std::string> {
+            char number_buffer[32];
+            return find({block, key.get_type(), detail::scalar_text(key, number_buffer)});
+        }
+
+        /// Store `text` for `block` under `key`, replacing any entry which is already there.
+        /// If `ttl` isn't zero, the entry expires once it has passed. Entries whose `ttl` would run past the
+        /// latest time `clock` can represent never expire.
+        /// \throws `koura::render_error` if `key` is an object or sequence.
+        void store (block_id block, const entity& key, std::string text, clock::duration ttl = {}) {
+            char number_buffer[32];
+            store({block, key.get_type(), detail::scalar_text(key, number_buffer)}, std::move(text), ttl);
+        }
+
+        /// Remove the entries of every block for `key`, so the next blocks which use it render their bodies again.
+        /// This looks at every entry, so it takes time proportional to the size of the cache.
+        /// \throws `koura::render_error` if `key` is an object or sequence.
+        void invalidate (const entity& key) {
+            char number_buffer[32];
+            auto type = key.get_type();
+            auto value = detail::scalar_text(key, number_buffer);
+
+            std::lock_guard lock {m_mutex};
+            for (auto it = m_entries.begin(); it != m_entries.end();) {
+                auto entry = it++;
+                if (entry->key.type == type && entry->key.value == value) {
+                    m_index.erase(entry->key);
+                    m_entries.erase(entry);
+                }
+            }
+        }
+
+        /// Remove the entries of every block for the text `key`.
+        void invalidate (std::string_view key) { invalidate(entity{text_t{key}}); }
+
+        /// Remove every entry.
+        void clear() {
+            std::lock_guard lock {m_mutex};
+            m_index.clear();
+            m_entries.clear();
+        }
+
+        /// Get the number of entries, including any which have expired but haven't been looked up since.
+        auto size() const -> std::size_t {
+            std::lock_guard lock {m_mutex};
+            return m_entries.size();
+        }
+
+    private:
+        friend class engine;
+
+        /// A block and the type and text of a key. The index's keys view the text of their entries.
+        struct key_view {
+            block_id block;
+            entity::type type;
+            std::string_view value;
+
+            friend bool operator== (const key_view& lhs, const key_view& rhs) {
+                return lhs.block == rhs.block && lhs.type == rhs.type && lhs.value == rhs.value;
+            }
+        };
+
+        struct key_hash {
+            auto operator() (const key_view& key) const -> std::size_t {
+                auto hash = std::hash<std::string_view>{}(key.value);
+                for (auto part : {std::size_t(key.block.tmpl), key.block.instruction, std::size_t(key.type)}) {
+                    hash ^= part + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+                }
+                return hash;
+            }
+        };
+
+        struct entry {
+            std::string value;
+            key_view key;
+            std::shared_ptr<const std::string> text;
+            std::optional<clock::time_point> expires;
+        };
+
+        auto find (const key_view& key) -> std::shared_ptr<const std::string> {
+            std::lock_guard lock {m_mutex};
+            auto it = m_index.find(key);
+            if (it == m_index.end()) {
+                return nullptr;
+            }
+
+            auto entry = it->second;
+            if (entry->expires && *entry->expires <= clock::now()) {
+                m_index.erase(it);
+                m_entries.erase(entry);
+                return nullptr;
+            }
+            m_entries.splice(m_entries.begin(), m_entries, entry);
+            return entry->text;
+        }
+
+        void store (const key_view& key, std::string text, clock::duration ttl) {
+            std::lock_guard lock {m_mutex};
+            erase(key);
+            if (m_capacity == 0) {
+                return;
+            }
+            if (m_entries.size() == m_capacity) {
+                erase(m_entries.back().key);
+            }
+
+            std::optional<clock::time_point> expires;
+            auto now = clock::now();
+            if (ttl < clock::duration::zero()) {
+                expires = now;
+            }
+            else if (ttl != clock::duration::zero() && ttl < clock::duration::max() - now.time_since_epoch()) {
+                expires = now + ttl;
+            }
+            auto& added = m_entries.emplace_front();
+            added.value = key.value;
+            added.key = {key.block, key.type, added.value};
+            added.text = std::make_shared<const std::string>(std::move(text));
+            added.expires = expires;
+            m_index.emplace(added.key, m_entries.begin());
+        }
+
+        void erase (key_view key) {
+            auto it = m_index.find(key);
+            if (it != m_index.end()) {
+                auto entry = it->second;
+                m_index.erase(it);
+                m_entries.erase(entry);
+            }
+        }
+
+        //Most recently used first. The index's keys point into the entries, which lists never move
+        std::list<entry> m_entries;
+        std::unordered_map<key_view, std::list<entry>::iterator, key_hash> m_index;
+        std::size_t m_capacity;
+        mutable std::mutex m_mutex;
+    };
+
+    /// Options which control a single render.
+    struct render_options {
+        /// Where the render's arena gets more memory from once its initial stack buffer is used up.
+        /// If this is null, the default memory resource is used.
+        /// When rendering with a `pool`, it's used from several threads at once, so it must be thread-safe.
+        std::pmr::memory_resource* upstream = nullptr;
+
+        /// If this is set, independent top-level `for` blocks and `if` chains are rendered into separate
+        /// buffers on the pool and written out in order. Parts of the template which contain `set`,
+        /// `flush` or custom tags are rendered on the calling thread once everything before them is done.
+        /// Filters must be safe to call from several threads, and a generator must only be looped over once.
+        thread_pool* pool = nullptr;
+
+        /// Where `cache` blocks store their text. If this is null, they render their bodies every time.
+        fragment_cache* cache = nullptr;
+    };
+
+#if KOURA_PROFILING
+    namespace detail {
+        /// One tag, filter or expression handler in a profiler's call tree, with the totals for every
+        /// time it ran under the same chain of `for` tags.
+        struct profile_node {
+            enum kind_t { tag, handler };
+
+            kind_t kind;
+            const void* key;
+            std::string name;
+            std::size_t line;
+            std::size_t count = 0;
+            std::chrono::steady_clock::duration time {};
+            std::size_t bytes = 0;
+            std::vector<std::unique_ptr<profile_node>> children {};
+        };
+
+        /// A `for` tag whose body is being rendered.
+        struct profile_frame {
+            profile_node* loop;
+            std::chrono::steady_clock::time_point start;
+        };
+    }
+
+    /// Records where the time goes when templates are rendered, see `engine::set_profiler`.
+    ///
+    /// Each tag which is run is counted and timed, along with the number of bytes it writes, and so is
+    /// each call to a filter or custom expression handler. A `for` tag's time includes its body, and the
+    /// tags in the body are recorded under it, so the results form a call tree.
+    /// This is only available when `KOURA_PROFILING` is defined to 1 before Koura is included;
+    /// otherwise the engine is built without any profiling hooks at all.
+    class profiler {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        /// The totals for one tag, line, filter or expression handler.
+        struct entry {
+            std::string name;
+            std::size_t count = 0;
+            clock::duration time {};
+            std::size_t bytes = 0;
+        };
+
+        profiler() = default;
+        profiler (const profiler&) = delete;
+        profiler& operator= (const profiler&) = delete;
+
+        /// The totals for each tag, named by its line and text, most expensive first.
+        /// A `for` tag's totals include its body. Text between tags is named `(text)`.
+        auto tags() const -> std::vector<entry> {
+            return collect(detail::profile_node::tag, true, [](const detail::profile_node& n) {
+                return "line " + std::to_string(n.line) + ": " + n.name;
+            });
+        }
+
+        /// The totals for each line of the template, most expensive first.
+        /// The body of a `for` tag counts towards its own lines rather than the line of the `for`.
+        auto lines() const -> std::vector<entry> {
+            return collect(detail::profile_node::tag, false, [](const detail::profile_node& n) {
+                return "line " + std::to_string(n.line);
+            });
+        }
+
+        /// The totals for each filter and custom expression handler, most expensive first.
+        /// A filter's bytes are the length of the text it produced.
+        auto handlers() const -> std::vector<entry> {
+            return collect(detail::profile_node::handler, true, [](const detail::profile_node& n) { return n.name; });
+        }
+
+        /// Write `tags`, `lines` and `handlers` to `out` as a table, with times in microseconds.
+        void write_report (std::ostream& out) const {
+            auto section = [&out](const char* title, const std::vector<entry>& entries) {
+                out << title << '\n';
+                for (auto&& e : entries) {
+                    char row[64];
+                    std::snprintf(row, sizeof(row), "%12zu %14.3f %12zu  ", e.count,
+                                  std::chrono::duration<double, std::micro>{e.time}.count(), e.bytes);
+                    out << row << e.name << '\n';
+                }
+                out << '\n';
+            };
+
+            out << "       count      time (us)        bytes  name\n\n";
+            section("tags", tags());
+            section("lines", lines());
+            section("handlers", handlers());
+        }
+
+        /// Write the time spent in each chain of tags to `out` in the folded stack format read by
+        /// flame graph tools such as `flamegraph.pl`: one line per chain, with the frames separated by
+        /// semicolons, followed by the time spent in the last frame itself in nanoseconds.
+        void write_folded (std::ostream& out) const {
+            std::lock_guard lock {m_mutex};
+            std::string stack;
+            for (auto&& child : m_root.children) {
+                write_folded(out, *child, stack);
+            }
+        }
+
+        /// Forget everything recorded so far.
+        /// This must not be called while a render is being profiled.
+        void clear() {
+            std::lock_guard lock {m_mutex};
+            m_root.children.clear();
+        }
+
+    private:
+        friend class engine;
+
+        using node = detail::profile_node;
+
+        /// A tag which is being timed.
+        struct sample {
+            node* target;
+            clock::time_point start;
+        };
+
+        /// The node which tags and handlers run on this thread are recorded under.
+        static inline thread_local node* s_current = nullptr;
+
+        /// Start timing `instr`, which runs inside the innermost loop in `stack`.
+        auto begin (const std::vector<detail::profile_frame>& stack, const detail::instruction& instr) -> sample {
+            auto parent = stack.empty() ? &m_root : stack.back().loop;
+            auto target = child(parent, &instr, node::tag, instr.line, [&instr] {
+                return instr.op == detail::opcode::literal ? std::string{"(text)"} : std::string{instr.source};
+            });
+            s_current = target;
+            return {target, clock::now()};
+        }
+
+        /// Stop timing a tag which wrote `bytes` and entered (`loop_change` > 0) or left (< 0) a loop.
+        /// A loop which is entered is recorded when it's left, so its time includes its body.
+        void end (std::vector<detail::profile_frame>& stack, const sample& s, std::size_t bytes,
+                  std::ptrdiff_t loop_change) {
+            auto now = clock::now();
+            if (loop_change > 0) {
+                stack.push_back({s.target, s.start});
+                return;
+            }
+
+            add(s.target, now - s.start, bytes);
+            if (loop_change < 0 && !stack.empty()) {
+                add(stack.back().loop, now - stack.back().start, 0);
+                stack.pop_back();
+            }
+        }
+
+        /// Record a call to the handler `key`, called `kind name`, which started at `start` and wrote `bytes`.
+        void handled (const void* key, std::string_view kind, std::string_view name, clock::time_point start,
+                      std::size_t bytes) {
+            auto elapsed = clock::now() - start;
+            if (auto parent = s_current) {
+                auto target = child(parent, key, node::handler, parent->line, [&] {
+                    return std::string{kind} + ' ' + std::string{name};
+                });
+                add(target, elapsed, bytes);
+            }
+        }
+
+        template <class Name>
+        auto child (node* parent, const void* key, node::kind_t kind, std::size_t line, Name&& name) -> node* {
+            std::lock_guard lock {m_mutex};
+            for (auto& c : parent->children) {
+                if (c->key == key) {
+                    return c.get();
+                }
+            }
+            parent->children.push_back(std::make_unique<node>(node{kind, key, name(), line}));
+            return parent->children.back().get();
+        }
+
+        void add (node* target, clock::duration time, std::size_t bytes) {
+            std::lock_guard lock {m_mutex};
+            ++target->count;
+            target->time += time;
+            target->bytes += bytes;
+        }
+
+        /// Group the nodes of `kind` by `key`, using their totals including their children if `inclusive`,
+        /// or only what they spent themselves otherwise.
+        template <class Key>
+        auto collect (node::kind_t kind, bool inclusive, Key&& key) const -> std::vector<entry> {
+            std::lock_guard lock {m_mutex};
+            std::unordered_map<std::string, entry> groups;
+
+            auto visit = [&](auto& self, const node& n) -> void {
+                for (auto&& c : n.children) {
+                    self(self, *c);
+                }
+                if (n.kind != kind) {
+                    return;
+                }
+
+                auto& e = groups[key(n)];
+                e.count += n.count;
+                e.time += inclusive ? n.time : n.time - child_time(n);
+                e.bytes += inclusive ? total_bytes(n) : n.bytes;
+            };
+            for (auto&& c : m_root.children) {
+                visit(visit, *c);
+            }
+
+            std::vector<entry> entries;
+            for (auto&& [name, e] : groups) {
+                entries.push_back(std::move(e));
+                entries.back().name = name;
+            }
+            std::sort(entries.begin(), entries.end(), [](auto&& a, auto&& b) {
+                return a.time != b.time ? a.time > b.time : a.name < b.name;
+            });
+            return entries;
+        }
+
+        static auto child_time (const node& n) -> clock::duration {
+            clock::duration time {};
+            for (auto&& c : n.children) {
+                time += c->time;
+            }
+            return time;
+        }
+
+        /// The bytes written by `n` and the tags under it. Handlers' output is written by their tags,
+        /// so it isn't counted again.
+        static auto total_bytes (const node& n) -> std::size_t {
+            auto bytes = n.bytes;
+            for (auto&& c : n.children) {
+                if (c->kind == node::tag) {
+                    bytes += total_bytes(*c);
+                }
+            }
+            return bytes;
+        }
+
+        static void write_folded (std::ostream& out, const node& n, std::string& stack) {
+            auto size = stack.size();
+            if (size) {
+                stack += ';';
+            }
+            //Semicolons and line breaks would be read as frame and record separators
+            for (auto c : n.name) {
+                stack += c == ';' ? ',' : c == '\n' || c == '\r' ? ' ' : c;
+            }
+            if (n.kind == node::tag) {
+                stack += " (line " + std::to_string(n.line) + ")";
+            }
+
+            auto self = std::chrono::duration_cast<std::chrono::nanoseconds>(n.time - child_time(n)).count();
+            if (self > 0) {
+                out << stack << ' ' << self << '\n';
+            }
+            for (auto&& c : n.children) {
+                write_folded(out, *c, stack);
+            }
+            stack.resize(size);
+        }
+
+        node m_root {node::tag, nullptr, {}, 0};
+        mutable std::mutex m_mutex;
+    };
+#endif
+
+    namespace detail {
+        /// Get the path of the template file called `name` under `root`.
+        /// \throws `koura::render_error` if `name` is absolute or leads outside of `root`, such as `../secret`.
+        inline auto template_path (const std::filesystem::path& root, std::string_view name) -> std::filesystem::path {
+            auto relative = std::filesystem::path{name}.lexically_normal();
+            if (name.empty() || relative.has_root_path() || (!relative.empty() && *relative.begin() == "..")) {
+                throw render_error{};
+            }
+            return root / relative;
+        }
+    }
+
+    /// Create a loader which refuses every template, so `include` and `extends` tags fail to compile.
+    /// This is the default for templates compiled from text, so they can't read files unless asked to.
+    inline auto no_loader() -> template_loader {
+        return [](std::string_view) -> std::pair<std::shared_ptr<const void>, std::string_view> {
+            throw render_error{};
+        };
+    }
+
+    /// Create a loader which reads the template called `name` from the file `root / name`.
+    /// Names which are absolute or lead outside of `root` are rejected with `koura::render_error`.
+    /// Symbolic links under `root` are followed, so they must only point to files which templates may read.
+    /// Files are memory-mapped where possible, like `engine::compile_file`.
+    inline auto file_loader (std::filesystem::path root) -> template_loader {
+        return [root = std::move(root)](std::string_view name) {
+            return detail::map_file(detail::template_path(root, name));
+        };
+    }
+
+    /// A template which has been compiled by `engine::compile`.
+    ///
+    /// A compiled template holds a flat program of literal spans, variable lookups and jumps,
+    /// so rendering it never touches the template text again.
+    /// Literal spans are views into the template text, which the compiled template keeps alive.
+    class compiled_template {
+    public:
+        compiled_template() = default;
+
+    private:
+        friend class engine;
+        friend class live_render;
+
+        compiled_template (std::shared_ptr<const void> source, detail::compiled_program program,
+                           std::size_t max_loop_depth) :
+            m_source{std::move(source)}, m_program{std::move(program)}, m_max_loop_depth{max_loop_depth},
+            m_regions{detail::find_regions(m_program.code)}, m_id{next_id()}
+        {}
+
+        /// Get a new identity for a template, which its `cache` blocks are stored under.
+        static auto next_id() -> std::uint64_t {
+            static std::atomic<std::uint64_t> last {0};
+            return last.fetch_add(1, std::memory_order_relaxed) + 1;
+        }
+
+        std::shared_ptr<const void> m_source;
+        detail::compiled_program m_program;
+        std::size_t m_max_loop_depth = 0;
+        std::vector<detail::region> m_regions;
+        std::uint64_t m_id = 0;
+    };
+
+    namespace detail {
+        /// Everything a render needs to carry on from where it stopped.
+        /// Loop scopes point into the state, so it mustn't move once the render has started.
+        struct render_state {
+            render_state (const compiled_program& program, std::uint64_t tmpl, std::size_t max_loop_depth,
+                          std::ostream& out, context& ctx, const render_options& options) :
+                program{&program}, tmpl{tmpl}, out{&out}, scope{&ctx}, end{program.code.size()},
+                arena{initial_arena, sizeof(initial_arena),
+                      options.upstream ? options.upstream : std::pmr::get_default_resource()},
+                filter_buffers{std::pmr::string{&arena}, std::pmr::string{&arena}},
+                loops{&arena}, cache{options.cache}
+            {
+                loops.reserve(max_loop_depth);
+            }
+
+            render_state (const render_state&) = delete;
+            render_state& operator= (const render_state&) = delete;
+
+            const compiled_program* program;
+            //The identity of the template being rendered, which its `cache` blocks are stored under
+            std::uint64_t tmpl;
+            std::ostream* out;
+            context* scope;
+            std::size_t pc = 0;
+            std::size_t end;
+            std::optional<deferred> pending;
+
+            std::byte initial_arena[1024];
+            std::pmr::monotonic_buffer_resource arena;
+            //Filter chains ping-pong between these, so their capacity is reused for the whole render
+            std::pmr::string filter_buffers[2];
+            std::pmr::vector<loop_frame> loops;
+            fragment_cache* cache;
+            //If set, the paths read by each tag which runs are added to this, once each
+            std::vector<const std::vector<symbol>*>* reads = nullptr;
+            //While a `cache` block is being rendered, `out` is the innermost capture's stream
+            std::vector<std::unique_ptr<fragment_capture>> captures;
+#if KOURA_PROFILING
+            std::vector<profile_frame> profile;
+#endif
+        };
+    }
+
+    class render_task;
+    class live_render;
+
+    /// The texts rendered by `engine::render_batch`, stored one after another in a single buffer.
+    class batch_output {
+    public:
+        /// Get the number of texts.
+        auto size() const -> std::size_t { return m_offsets.size() - 1; }
+
+        /// Get the text rendered for row `i`.
+        auto operator[] (std::size_t i) const -> std::string_view {
+            return std::string_view{m_text}.substr(m_offsets[i], m_offsets[i + 1] - m_offsets[i]);
+        }
+
+        /// Get every text, one after another.
+        auto text() const -> std::string_view { return m_text; }
+
+        /// Get where each text starts in `text`, followed by where the last one ends.
+        auto offsets() const -> const std::vector<std::size_t>& { return m_offsets; }
+
+    private:
+        friend class engine;
+
+        std::string m_text;
+        std::vector<std::size_t> m_offsets {0};
+    };
+
+    /// The Koura rendering engine.
+    ///
+    /// Compiling and rendering don't modify the engine, so one engine can be shared by any number of
+    /// threads, as long as filters and expression handlers are registered before rendering starts.
+    class engine {
+    public:
+        /// The type of a custom expression handler.
+        /// Handlers run on the render's thread, so waiting on a deferred entity, for example through
+        /// `entity::get_type`, blocks the render rather than suspending it.
+        using expression_handler_t = std::function<void(const engine&,std::istream&, std::ostream&,
+                                                        context&, const std::any&)>;
+
+        /// The type of a custom text filter.
+        using filter_t = std::function<std::string(std::string_view, context&)>;
+
+        /// The type of a streaming text filter, which appends the filtered text to a buffer.
+        /// The buffer is reused between filters and renders, so chains of streaming filters don't allocate.
+        using stream_filter_t = std::function<void(std::string_view, std::pmr::string&, context&)>;
+
+        /// The type of a formatting filter, which can take a whole number argument, as in `{{ price | fixed: 2 }}`.
+        /// The first filter on a number variable is given the number itself, and any other filter is given text.
+        /// The argument is empty when the filter is used without one.
+        using format_filter_t = std::function<void(const format_value&, std::pmr::string&, std::optional<std::size_t>)>;
+
+        engine() :
+            m_filters{
+              {"capitalise", filters::upper},
+              {"upper", filters::upper},
+              {"lower", filters::lower},
+              {"escape_html", filters::escape_html},
+              {"escape_url", filters::escape_url},
+              {"escape_json", filters::escape_json},
+              {"trim", filters::trim}
+            },
+            m_format_filters{
+              {"fixed", filters::fixed},
+              {"thousands", filters::thousands},
+              {"pad", filters::pad},
+              {"zero_pad", filters::zero_pad}
+            }
+        {}
+
+
+        /// Render the text from `in` to `out` using the context `ctx`.
+        /// The text is read in a single pass, so `in` doesn't need to be seekable.
+        void render (std::istream& in, std::ostream& out, context& ctx) const {
+            render(compile(in), out, ctx);
+        }
+
+        /// Render the template text `text` to `out` using the context `ctx`.
+        /// The text is compiled in place, without being copied. It can't include or extend other templates.
+        void render (std::string_view text, std::ostream& out, context& ctx) const {
+            render(compile_source(nullptr, text, no_loader()), out, ctx);
+        }
+
+        /// Compile the template text from `in` into a program which can be rendered many times.
+        /// Included and extended templates are found with `loader`, as for `compile(std::string_view)`.
+        /// \throws `koura::render_error` if the template is malformed.
+        auto compile (std::istream& in, const template_loader& loader = no_loader()) const -> compiled_template {
+            auto source = std::make_shared<const std::string>(detail::read_all(in));
+            return compile_source(source, *source, loader);
+        }
+
+        /// Compile the template text `text` into a program which can be rendered many times.
+        /// The compiled template keeps its own copy of `text`.
+        ///
+        /// Templates named by `include` and `extends` tags are found with `loader`, such as a `file_loader`.
+        /// By default there is no loader, so those tags are errors and compiling never reads any files.
+        /// Included templates are linked into the compiled program, so rendering it never loads them again.
+        /// \throws `koura::render_error` if the template is malformed.
+        auto compile (std::string_view text, const template_loader& loader = no_loader()) const -> compiled_template {
+            auto source = std::make_shared<const std::string>(text);
+            return compile_source(source, *source, loader);
+        }
+
+        /// Compile the template file at `path` into a program which can be rendered many times.
+        /// The file is memory-mapped and literal text is rendered straight from the mapping, which
+        /// the compiled template keeps alive.
+        /// Templates which it includes or extends are found relative to the directory containing it.
+        /// \throws `koura::render_error` if the template is malformed and
+        /// `std::system_error` if the file can't be read.
+        auto compile_file (const std::filesystem::path& path) const -> compiled_template {
+            return compile_file(path, file_loader(path.parent_path()));
+        }
+
+        /// Compile the template file at `path`, finding the templates which it includes or extends with `loader`.
+        /// \throws `koura::render_error` if the template is malformed and
+        /// `std::system_error` if the file can't be read.
+        auto compile_file (const std::filesystem::path& path, const template_loader& loader) const -> compiled_template {
+            auto [source, text] = detail::map_file(path);
+            return compile_source(std::move(source), text, loader);
+        }
+
+        /// Specialise `tmpl` for `constants`, entities whose values are the same in every context it will be
+        /// rendered with, such as feature flags and site settings.
+        ///
+        /// Variables which only read constants are rendered now, filters included, and `if` and `unless` tags
+        /// on constants are decided, so branches which can't be taken cost nothing at render time.
+        /// Reads after a top-level `set` tag which gives a constant a literal value are folded with the new value.
+        /// The `set` tag itself is kept, so the constants must be in the render context as well.
+        /// Lookups which fail are left in place to be reported by the render.
+        /// \requires Filters used on constants always give the same result for the same text.
+        auto optimise (const compiled_template& tmpl, context& constants) const -> compiled_template {
+            auto text = std::make_shared<std::pair<std::shared_ptr<const void>, std::deque<std::string>>>();
+            text->first = tmpl.m_source;
+
+            auto fold_variable = [this](const detail::tag_args& args, context& ctx, std::string& out) {
+                char number_buffer[32];
+                std::pmr::string buffers[2];
+                try {
+                    out = variable_text(args, ctx, number_buffer, buffers);
+                    return true;
+                }
+                catch (render_error&) {}
+                catch (detail::suspension&) {}
+                return false;
+            };
+
+            auto program = detail::fold_constants(tmpl.m_program, constants, fold_variable, text->second);
+            auto max_loop_depth = detail::max_loop_depth(program.code);
+            return compiled_template{std::move(text), std::move(program), max_loop_depth};
+        }
+
+        /// Render the compiled template `tmpl` to `out` using the context `ctx`.
+        ///
+        /// Temporaries such as loop scopes and filter results are allocated from an arena which starts
+        /// out on the stack and is released in one go when the render returns.
+        /// If the template needs the value of a `koura::deferred` entity which isn't available yet,
+        /// the text rendered so far is flushed and the render waits for it.
+        /// If `options.pool` is set, independent parts of the template are rendered in parallel.
+        void render (const compiled_template& tmpl, std::ostream& out, context& ctx,
+                     const render_options& options = {}) const {
+            std::ostream::sentry sentry {out};
+            if (!sentry) {
+                return;
+            }
+
+            if (!options.pool) {
+                render_region(tmpl, {0, tmpl.m_program.code.size(), false}, out, ctx, options);
+                return;
+            }
+
+            auto& regions = tmpl.m_regions;
+            for (std::size_t first = 0; first < regions.size();) {
+                auto last = first + 1;
+                while (last < regions.size() && regions[first].parallel && regions[last].parallel) {
+                    ++last;
+                }
+
+                if (last - first == 1) {
+                    render_region(tmpl, regions[first], out, ctx, options);
+                }
+                else {
+                    render_parallel(tmpl, &regions[first], last - first, out, ctx, options);
+                }
+                first = last;
+            }
+        }
+
+        /// Start rendering the compiled template `tmpl` to `out` using the context `ctx`.
+        /// Nothing is rendered until the returned task is resumed, see `koura::render_task`.
+        /// The task renders the template in order on the thread which resumes it, so `options.pool` is ignored.
+        auto render_async (const compiled_template& tmpl, std::ostream& out, context& ctx,
+                           const render_options& options = {}) const -> render_task;
+
+        /// The task would refer to the template after it had been destroyed.
+        auto render_async (compiled_template&&, std::ostream&, context&, const render_options& = {}) const
+            -> render_task = delete;
+
+        /// Render the compiled template `tmpl` using the context `ctx` into a `live_render`, which can bring
+        /// its text up to date after changes to `ctx` by re-rendering only the parts which depend on them.
+        /// The template is rendered in order on the calling thread, so `options.pool` is ignored.
+        auto render_live (const compiled_template& tmpl, context& ctx, const render_options& options = {}) const
+            -> live_render;
+
+        /// The live render would refer to the template after it had been destroyed.
+        auto render_live (compiled_template&&, context&, const render_options& = {}) const -> live_render = delete;
+
+        /// Render the compiled template `tmpl` once for each context in `contexts`, a random-access range,
+        /// into one `batch_output`.
+        ///
+        /// Each render writes straight onto the end of the output buffer, so there's no per-row parsing,
+        /// stream or buffer to set up. If `options.pool` is set, the rows are split into contiguous shards
+        /// which are rendered in parallel and joined in order, so the contexts mustn't share entities which
+        /// the template changes.
+        template <class Range>
+        auto render_batch (const compiled_template& tmpl, Range& contexts, const render_options& options = {}) const
+            -> batch_output {
+            auto first = std::begin(contexts);
+            auto count = static_cast<std::size_t>(std::distance(first, std::end(contexts)));
+            return render_rows(tmpl, count, [first](std::size_t i, context&) -> context& { return first[i]; }, options);
+        }
+
+        /// Render the compiled template `tmpl` once for each of `count` rows into one `batch_output`,
+        /// calling `fill(row, ctx)` to set up the context for each row.
+        ///
+        /// This suits columnar data, where `fill` can bind each column's value for the row with
+        /// `context::bind_entity` instead of copying it. The context is reused from row to row, so
+        /// entities which one row adds are still there for the next unless they're replaced.
+        /// If `options.pool` is set, `fill` is called from several threads at once, each with its own context.
+        template <class Fill>
+        auto render_batch (const compiled_template& tmpl, std::size_t count, Fill fill,
+                           const render_options& options = {}) const -> batch_output {
+            return render_rows(tmpl, count, [&fill](std::size_t i, context& ctx) -> context& {
+                fill(i, ctx);
+                return ctx;
+            }, options);
+        }
+
+        /// Render the compiled template `tmpl` to `sink` using the context `ctx`.
+        /// Any text left in the sink's buffer is handed to its callback when the render finishes.
+        void render (const compiled_template& tmpl, output_sink& sink, context& ctx,
+                     const render_options& options = {}) const {
+            std::ostream out {&sink};
+            render(tmpl, out, ctx, options);
+            sink.flush();
+        }
+
+        /// Register a custom expression handler.
+        /// This must not be called while another thread is using the engine.
+        /// The handler is given a stream over the rest of its tag, up to and including the closing `%}`.
+        /// Handlers which need the text after their tag should be registered with `register_custom_block`.
+        void register_custom_expression (std::string_view name, expression_handler_t handler, std::any data) {
+            m_expression_handlers.emplace(symbol{name}, std::make_pair(handler, std::move(data)));
+        }
+
+        /// Register a custom block tag, which runs up to a matching `{% end<name> %}` tag.
+        /// This must not be called while another thread is using the engine.
+        /// The handler is given a stream over the rest of its opening tag, its body and its closing tag, so it
+        /// can render the body as it likes, for example with `handle_variable_tag` and `handle_expression_tag`.
+        /// Templates compiled before the block is registered treat it as a tag without a body.
+        void register_custom_block (std::string_view name, expression_handler_t handler, std::any data) {
+            register_custom_expression(name, std::move(handler), std::move(data));
+            m_custom_blocks.insert(symbol{name});
+        }
+
+        /// Render the variable tag at the start of `in`, just after its opening `{{`, to `out`.
+        /// This reads up to and including the closing `}}`, and is meant for custom block handlers.
+        /// \throws `koura::render_error` if the tag is malformed.
+        void handle_variable_tag (std::istream& in, std::ostream& out, context& ctx) const {
+            auto text = "{{" + detail::read_through(in, "}}");
+            render(std::string_view{text}, out, ctx);
+        }
+
+        /// Run the expression tag at the start of `in`, just after its opening `{%`, writing to `out`.
+        /// The body of a block tag such as `for` is read up to its closing tag, and custom handlers are given
+        /// `in` itself. This is meant for custom block handlers.
+        /// \throws `koura::render_error` if the tag is malformed.
+        void handle_expression_tag (std::istream& in, std::ostream& out, context& ctx) const {
+            auto name = detail::get_identifier(in);
+            auto key = symbol::find(name);
+            auto handler = key ? m_expression_handlers.find(*key) : m_expression_handlers.end();
+            if (handler != m_expression_handlers.end()) {
+                auto&& [fn, data] = handler->second;
+                fn(*this, in, out, ctx, data);
+                return;
+            }
+
+            //Built-in tags are compiled along with their bodies, which end at the matching closing tag
+            auto text = "{% " + name + detail::read_through(in, "%}");
+            if (name == "if" || name == "unless" || name == "for" || name == "cache") {
+                auto end_tag = "end" + name;
+                for (std::size_t depth = 1; depth > 0;) {
+                    text += detail::read_through(in, "{%");
+                    detail::eat_whitespace(in);
+                    auto tag = detail::get_identifier(in);
+                    depth = tag == name ? depth + 1 : tag == end_tag ? depth - 1 : depth;
+                    text += tag + detail::read_through(in, "%}");
+                }
+            }
+            render(std::string_view{text}, out, ctx);
+        }
+
+        /// Run the filter named at the start of `in`, with any argument as in `fixed: 2`, over `text`.
+        /// \throws `koura::render_error` if there is no such filter.
+        auto handle_filter (std::istream& in, context& ctx, std::string_view text) const -> std::string {
+            auto name = symbol::find(detail::get_identifier(in));
+            std::optional<std::size_t> arg;
+            detail::eat_whitespace(in);
+            if (in.peek() == ':') {
+                in.get();
+                if (!(in >> std::ws >> arg.emplace())) {
+                    throw render_error{in};
+                }
+            }
+
+            std::pmr::string out;
+            auto filter = name ? m_filters.find(*name) : m_filters.end();
+            auto format = name ? m_format_filters.find(*name) : m_format_filters.end();
+            if (filter != m_filters.end() && !arg) {
+                filter->second(text, out, ctx);
+            }
+            else if (format != m_format_filters.end()) {
+                format->second(text, out, arg);
+            }
+            else {
+                throw render_error{in};
+            }
+            return std::string{out};
+        }
+
+        /// Register a custom text filter.
+        /// This must not be called while another thread is using the engine.
+        /// After a filter is registered, it can be used just like a normal filter
+        /// E.g. `eng.register_custom_filter("upcase_even", upcase_even);` `{{thing | upcase_even}}`
+        void register_custom_filter (std::string_view name, filter_t filter) {
+            m_filters.emplace(symbol{name}, [filter = std::move(filter)](std::string_view text, std::pmr::string& out, context& ctx) {
+                out += filter(text, ctx);
+            });
+        }
+
+        /// Register a custom streaming text filter.
+        /// This must not be called while another thread is using the engine.
+        void register_stream_filter (std::string_view name, stream_filter_t filter) {
+            m_filters.emplace(symbol{name}, std::move(filter));
+        }
+
+        /// Register a custom formatting filter, which can be given an argument.
+        /// If a text filter has the same name, it's used when no argument is given.
+        /// This must not be called while another thread is using the engine.
+        void register_format_filter (std::string_view name, format_filter_t filter) {
+            m_format_filters.emplace(symbol{name}, std::move(filter));
+        }
+
+#if KOURA_PROFILING
+        /// Record every render by this engine in `prof`, or stop recording if it's null.
+        /// The profiler must outlive the renders which use it.
+        /// This must not be called while another thread is using the engine.
+        void set_profiler (profiler* prof) { m_profiler = prof; }
+#endif
+
+    private:
+        friend class render_task;
+        friend class live_render;
+        template <class Source> friend class static_template;
+
+        /// Carry on with the render in `state`, returning `true` once it has finished.
+        /// If it reaches a deferred entity which isn't available yet, the output is flushed, the entity
+        /// is stored in `state.pending` and `false` is returned. Calling `run` again retries the same tag.
+        bool run (detail::render_state& state) const {
+            using detail::opcode;
+
+            auto& program = *state.program;
+            auto& pc = state.pc;
+            state.pending.reset();
+
+#if KOURA_PROFILING
+            //Handlers are recorded under the tag which is running on this thread, which nested renders change
+            struct current_guard {
+                detail::profile_node* saved = profiler::s_current;
+                ~current_guard() { profiler::s_current = saved; }
+            } guard;
+#endif
+
+            //Every tag resolves its paths before it has any effects, so a suspended tag can just be run again
+            try {
+                while (pc < state.end) {
+                    auto& instr = program.code[pc];
+                    [[maybe_unused]] std::size_t bytes = 0;
+                    if (state.reads && instr.tag != detail::instruction::no_tag) {
+                        detail::record_reads(program.args_of(instr), *state.reads);
+                    }
+#if KOURA_PROFILING
+                    auto loop_depth = state.loops.size();
+                    profiler::sample sample {};
+                    if (m_profiler) {
+                        sample = m_profiler->begin(state.profile, instr);
+                    }
+#endif
+
+                    switch (instr.op) {
+                    case opcode::literal:
+                        detail::write_text(*state.out, instr.text);
+                        bytes = instr.text.size();
+                        ++pc;
+                        break;
+
+                    case opcode::variable:
+                        bytes = render_variable(program.args_of(instr), *state.out, *state.scope, state.filter_buffers);
+                        ++pc;
+                        break;
+
+                    case opcode::branch:
+                        pc = detail::evaluate_condition(program.args_of(instr).arg, *state.scope) != instr.negate ?
+                             pc + 1 : instr.jump;
+                        break;
+
+                    case opcode::jump:
+                        pc = instr.jump;
+                        break;
+
+                    case opcode::loop:
+                    {
+                        auto& args = program.args_of(instr);
+                        if (args.arg.path.empty()) {
+                            throw render_error{};
+                        }
+
+                        entity scratch;
+                        auto& ent = detail::resolve_path(args.arg.path, *state.scope, scratch);
+                        if (ent.get_type() != entity::type::sequence) {
+                            throw render_error{};
+                        }
+
+                        //Frames are never reallocated, as scopes of nested loops point into them
+                        state.loops.emplace_back(args.name, args.arg.path, ent, *state.scope, &state.arena);
+                        if (!state.loops.back().next()) {
+                            state.loops.pop_back();
+                            pc = instr.jump;
+                            break;
+                        }
+
+                        state.scope = &state.loops.back().scope;
+                        ++pc;
+                        break;
+                    }
+
+                    case opcode::end_loop:
+                    {
+                        auto& frame = state.loops.back();
+                        if (frame.next()) {
+                            pc = instr.jump;
+                        }
+                        else {
+                            state.scope = frame.outer;
+                            state.loops.pop_back();
+                            ++pc;
+                        }
+                        break;
+                    }
+
+                    case opcode::set:
+                        detail::assign(program.args_of(instr), *state.scope);
+                        ++pc;
+                        break;
+
+                    case opcode::flush:
+                        state.out->flush();
+                        ++pc;
+                        break;
+
+                    case opcode::custom:
+                    {
+                        auto& tag = program.args_of(instr);
+                        auto handler = m_expression_handlers.find(tag.name);
+                        if (handler == m_expression_handlers.end()) {
+                            throw render_error{};
+                        }
+
+                        detail::view_streambuf buf {tag.args};
+                        std::istream args {&buf};
+                        auto&& [fn, data] = handler->second;
+#if KOURA_PROFILING
+                        profiler::clock::time_point started;
+                        std::streampos before {-1};
+                        if (m_profiler) {
+                            started = profiler::clock::now();
+                            before = state.out->tellp();
+                        }
+#endif
+                        fn(*this, args, *state.out, *state.scope, data);
+#if KOURA_PROFILING
+                        if (m_profiler) {
+                            //Streams which can't report their position leave the handler's bytes unknown
+                            auto after = state.out->tellp();
+                            if (before != std::streampos{-1} && after != std::streampos{-1}) {
+                                bytes = static_cast<std::size_t>(after - before);
+                            }
+                            m_profiler->handled(&handler->second, "tag", tag.name.name(), started, bytes);
+                        }
+#endif
+                        ++pc;
+                        break;
+                    }
+
+                    case opcode::cache:
+                    {
+                        if (!state.cache) {
+                            ++pc;
+                            break;
+                        }
+
+                        auto& args = program.args_of(instr);
+                        entity scratch, ttl_scratch;
+                        char number_buffer[32];
+                        auto& key = detail::evaluate(args.arg, *state.scope, scratch);
+                        auto type = key.get_type();
+                        auto value = detail::scalar_text(key, number_buffer);
+                        auto& ttl = detail::evaluate(args.value, *state.scope, ttl_scratch);
+                        if (ttl.get_type() != entity::type::number || detail::number_of(ttl) < 0) {
+                            throw render_error{};
+                        }
+
+                        if (auto text = state.cache->find({{state.tmpl, pc}, type, value})) {
+                            detail::write_text(*state.out, *text);
+                            bytes = text->size();
+                            pc = instr.jump;
+                            break;
+                        }
+
+                        //Converting seconds to the clock's ticks overflows for huge TTLs, which never expire anyway
+                        constexpr auto max_seconds =
+                            std::chrono::duration_cast<std::chrono::seconds>(fragment_cache::clock::duration::max());
+                        auto seconds = std::chrono::seconds{detail::number_of(ttl)};
+                        auto& capture = state.captures.emplace_back(std::make_unique<detail::fragment_capture>(
+                            pc, type, value, seconds < max_seconds ? seconds : fragment_cache::clock::duration::max(),
+                            state.out));
+                        state.out = &capture->out;
+                        ++pc;
+                        break;
+                    }
+
+                    case opcode::end_cache:
+                    {
+                        //Without a cache, or when the block's text was found, nothing was captured
+                        if (state.cache) {
+                            auto capture = std::move(state.captures.back());
+                            state.captures.pop_back();
+                            state.out = capture->outer;
+                            detail::write_text(*state.out, capture->text);
+                            state.cache->store({{state.tmpl, capture->instruction}, capture->type, capture->key},
+                                               std::move(capture->text), capture->ttl);
+                        }
+                        ++pc;
+                        break;
+                    }
+                    }
+#if KOURA_PROFILING
+                    if (m_profiler) {
+                        m_profiler->end(state.profile, sample, bytes,
+                                        static_cast<std::ptrdiff_t>(state.loops.size()) - static_cast<std::ptrdiff_t>(loop_depth));
+                    }
+#endif
+                }
+            }
+            catch (detail::suspension& suspended) {
+                state.pending = std::move(suspended.pending);
+                //Text captured by `cache` blocks isn't written until they end
+                (state.captures.empty() ? state.out : state.captures.front()->outer)->flush();
+                return false;
+            }
+
+            return true;
+        }
+
+        void render_region (const compiled_template& tmpl, detail::region range, std::ostream& out, context& ctx,
+                            const render_options& options) const {
+            detail::render_state state {tmpl.m_program, tmpl.m_id, tmpl.m_max_loop_depth, out, ctx, options};
+            state.pc = range.begin;
+            state.end = range.end;
+            while (!run(state)) {
+                state.pending->wait();
+            }
+        }
+
+        /// Render the instructions [`begin`, `end`) of `tmpl` into `out`, adding the paths they read to `reads`.
+        void render_segment (const compiled_template& tmpl, std::size_t begin, std::size_t end, std::string& out,
+                             context& ctx, const render_options& options,
+                             std::vector<const std::vector<symbol>*>& reads) const {
+            detail::string_writer buf {out};
+            std::ostream stream {&buf};
+            detail::render_state state {tmpl.m_program, tmpl.m_id, tmpl.m_max_loop_depth, stream, ctx, options};
+            state.pc = begin;
+            state.end = end;
+            state.reads = &reads;
+            while (!run(state)) {
+                state.pending->wait();
+            }
+        }
+
+        /// Render `count` parallel regions into their own buffers, using the calling thread as well as the pool.
+        void render_parallel (const compiled_template& tmpl, const detail::region* regions, std::size_t count,
+                              std::ostream& out, context& ctx, const render_options& options) const {
+            std::vector<std::string> outputs (count);
+            run_parallel(*options.pool, count, [&](std::size_t i) {
+                detail::string_writer buf {outputs[i]};
+                std::ostream region_out {&buf};
+                render_region(tmpl, regions[i], region_out, ctx, options);
+            });
+
+            for (auto&& text : outputs) {
+                detail::write_text(out, text);
+            }
+        }
+
+        /// Run `task` for each index below `count`, using the calling thread as well as the pool,
+        /// and return once they have all finished.
+        /// \throws the exception thrown by the task with the lowest index, if any threw.
+        static void run_parallel (thread_pool& pool, std::size_t count, const std::function<void(std::size_t)>& task) {
+            struct shared_state {
+                std::atomic<std::size_t> next {0};
+                std::atomic<std::size_t> remaining;
+                std::vector<std::exception_ptr> errors;
+                std::mutex mutex;
+                std::condition_variable finished;
+            };
+
+            auto shared = std::make_shared<shared_state>();
+            shared->remaining = count;
+            shared->errors.resize(count);
+
+            //Workers which start after every task has been claimed return straight away,
+            //so only `shared` needs to outlive this call
+            auto work = [shared, count, &task] {
+                for (std::size_t i; (i = shared->next++) < count;) {
+                    try {
+                        task(i);
+                    }
+                    catch (...) {
+                        shared->errors[i] = std::current_exception();
+                    }
+
+                    if (--shared->remaining == 0) {
+                        std::lock_guard lock {shared->mutex};
+                        shared->finished.notify_all();
+                    }
+                }
+            };
+
+            for (std::size_t i = 0; i < std::min(pool.size(), count - 1); ++i) {
+                pool.submit(work);
+            }
+            work();
 
-            auto& ent = ctx.get_entity(std::string{name});
+            std::unique_lock lock {shared->mutex};
+            shared->finished.wait(lock, [&shared] { return shared->remaining == 0; });
 
-            eat_whitespace(in);
+            for (auto&& error : shared->errors) {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+            }
+        }
 
-            if (ent.get_type() == entity::type::text || ent.get_type() == entity::type::number) {
-                return ent;
+        /// Render `count` rows into one `batch_output`, getting the context for each from `row(index, scratch)`.
+        template <class Row>
+        auto render_rows (const compiled_template& tmpl, std::size_t count, Row&& row,
+                          const render_options& options) const -> batch_output {
+            batch_output output;
+            output.m_offsets.reserve(count + 1);
+            if (!options.pool || count < 2) {
+                render_shard(tmpl, 0, count, row, options, output.m_text, output.m_offsets);
+                return output;
             }
-            else if (ent.get_type() == entity::type::object) {
-                auto next = in.peek();
 
-                if (next == '.') {
-                    in.get();
-                    return parse_nested_object(in, ent);
-                }
+            //More shards than threads, so threads which finish early can take on more
+            auto shard_count = std::min(count, (options.pool->size() + 1) * 4);
+            auto shard_begin = [count, shard_count](std::size_t shard) { return count * shard / shard_count; };
+            std::vector<std::string> texts (shard_count);
+            std::vector<std::vector<std::size_t>> ends (shard_count);
+            run_parallel(*options.pool, shard_count, [&](std::size_t shard) {
+                render_shard(tmpl, shard_begin(shard), shard_begin(shard + 1), row, options, texts[shard], ends[shard]);
+            });
+
+            std::size_t total = 0;
+            for (auto&& text : texts) {
+                total += text.size();
             }
-            else if (ent.get_type() == entity::type::sequence) {
-                return ent;
+            output.m_text.reserve(total);
+            for (std::size_t shard = 0; shard < shard_count; ++shard) {
+                auto base = output.m_text.size();
+                output.m_text += texts[shard];
+                for (auto end : ends[shard]) {
+                    output.m_offsets.push_back(base + end);
+                }
             }
+            return output;
         }
 
-        inline koura::entity parse_entity (std::istream& in, koura::context& ctx) {
-            auto c = peek(in);
-            //String literal
-            if (c == '\'') {
-                in.get();
-                koura::text_t text;
-                while (in.peek() != '\'') {
-                    text += in.get();
+        /// Render the rows [`begin`, `end`) one after another into `text`, adding the end of each to `ends`.
+        template <class Row>
+        void render_shard (const compiled_template& tmpl, std::size_t begin, std::size_t end, Row& row,
+                           const render_options& options, std::string& text, std::vector<std::size_t>& ends) const {
+            detail::string_writer buf {text};
+            std::ostream out {&buf};
+            context scratch {};
+            for (auto i = begin; i < end; ++i) {
+                render_region(tmpl, {0, tmpl.m_program.code.size(), false}, out, row(i, scratch), options);
+                ends.push_back(text.size());
+
+                //Rows usually come out at similar lengths, so make room for the rest of the shard up front.
+                //The estimate is capped, so one unusually long first row doesn't reserve far too much.
+                if (i == begin) {
+                    constexpr std::size_t max_reserve = 1 << 20;
+                    text.reserve(std::min(text.size() * (end - begin), std::max(max_reserve, text.size())));
                 }
-                in.get();
-                return entity{text};
             }
-            //Number literal
-            else if (std::isdigit(c)) {
-                koura::number_t num;
-                in >> num;
-                return entity{num};
-            }
-            //List literal
-            else if (c == '[') {
-                //TODO
+        }
+
+        auto compile_source (std::shared_ptr<const void> source, std::string_view text,
+                             const template_loader& loader) const -> compiled_template {
+            detail::link_state link {&loader, {std::move(source)}, {}, &m_custom_blocks};
+            detail::compiler comp {text, &link};
+            auto program = comp.compile();
+
+            //Literal spans point into every template which was linked in, so keep them all alive
+            if (link.sources.size() > 1) {
+                source = std::make_shared<const std::vector<std::shared_ptr<const void>>>(std::move(link.sources));
             }
-            //Named entity
             else {
-                return parse_named_entity(in,ctx);
+                source = std::move(link.sources.front());
             }
+            return compiled_template{std::move(source), std::move(program), comp.max_loop_depth()};
+        }
 
-            throw render_error{in};
+        /// Write the variable tag with `args` to `out`, returning the number of bytes written.
+        auto render_variable (const detail::tag_args& args, std::ostream& out, context& ctx,
+                              std::pmr::string (&buffers)[2]) const -> std::size_t {
+            char number_buffer[32];
+            auto text = variable_text(args, ctx, number_buffer, buffers);
+            detail::write_text(out, text);
+            return text.size();
         }
 
+        /// Look up the variable tag with `args` and run it through its filters.
+        /// The result may point into `number_buffer` or `buffers`.
+        auto variable_text (const detail::tag_args& args, context& ctx, char (&number_buffer)[32],
+                            std::pmr::string (&buffers)[2]) const -> std::string_view {
+            entity scratch;
+            auto& ent = detail::resolve_path(args.arg.path, ctx, scratch);
+            auto text = detail::scalar_text(ent, number_buffer);
 
-        inline void expect_text(std::istream& in, std::string_view expected) {
-            std::string got;
-            in >> got;
-            if (got != expected) {
-                throw render_error{in};
+            //Each stage reads the previous stage's buffer and writes to the other one
+            for (std::size_t i = 0; i < args.filters.size(); ++i) {
+                auto& call = args.filters[i];
+                auto& buffer = buffers[i % 2];
+                buffer.clear();
+#if KOURA_PROFILING
+                profiler::clock::time_point started;
+                if (m_profiler) {
+                    started = profiler::clock::now();
+                }
+#endif
+                [[maybe_unused]] const void* handler;
+                auto filter = m_filters.find(call.name);
+                if (filter != m_filters.end() && !call.arg) {
+                    filter->second(text, buffer, ctx);
+                    handler = &filter->second;
+                }
+                else {
+                    auto format = m_format_filters.find(call.name);
+                    if (format == m_format_filters.end()) {
+                        throw render_error{};
+                    }
+                    //Only the first filter sees the variable, so numbers aren't read back from text
+                    format->second(i == 0 ? detail::format_value_of(ent, text) : format_value{text}, buffer, call.arg);
+                    handler = &format->second;
+                }
+#if KOURA_PROFILING
+                if (m_profiler) {
+                    m_profiler->handled(handler, "filter", call.name.name(), started, buffer.size());
+                }
+#endif
+                text = buffer;
             }
+
+            return text;
         }
 
-        inline void eat_tag (std::istream& in) {
-            eat_whitespace(in);
+        std::unordered_map<symbol, std::pair<expression_handler_t,std::any>> m_expression_handlers;
+        std::unordered_set<symbol> m_custom_blocks;
+        std::unordered_map<symbol, stream_filter_t> m_filters;
+        std::unordered_map<symbol, format_filter_t> m_format_filters;
+#if KOURA_PROFILING
+        profiler* m_profiler = nullptr;
+#endif
+    };
 
-            if (in.get() != '{') {
-                throw render_error{in};
+    /// A render which stops part way through when it needs a value which isn't available yet.
+    ///
+    /// Each call to `resume` renders as far as it can. When the template needs the value of a
+    /// `koura::deferred` entity which hasn't arrived, the text rendered so far is flushed and `resume`
+    /// returns `false`, so the caller can get on with other work until `ready` returns `true`.
+    /// Deferred values start being fetched when they're created, so independent lookups overlap.
+    ///
+    /// The engine, template, output stream and context must outlive the task.
+    class render_task {
+    public:
+        /// Carry on rendering, returning `true` once the render has finished.
+        /// \throws `koura::render_error` if the template can't be rendered with its context.
+        bool resume() {
+            if (!m_done) {
+                m_done = m_engine->run(*m_state);
             }
+            return m_done;
+        }
 
-            if (in.get() != '%') {
-                throw render_error{in};
-            }
+        /// Return whether the render has finished.
+        bool done() const { return m_done; }
 
-            while (in.get() != '%') {
-            }
+        /// Return whether the next call to `resume` can make progress without waiting.
+        bool ready() const { return m_done || !m_state->pending || m_state->pending->ready(); }
 
-            if (in.get() != '}') {
-                throw render_error{in};
+        /// Block until the value the render is waiting for is available.
+        void wait() const {
+            if (!ready()) {
+                m_state->pending->wait();
             }
-
-            eat_single_trailing_whitespace(in);
         }
 
-        inline bool is_truthy (entity& ent) {
-            return true;
+        /// Render the rest of the template, waiting for deferred values as they are needed.
+        void finish() {
+            while (!resume()) {
+                wait();
+            }
         }
 
-        inline bool is_next_tag (std::istream& in, std::string_view tag) {
-            auto start_pos = in.tellg();
-            auto reset = [start_pos,&in] {in.seekg(start_pos);};
+    private:
+        friend class engine;
 
-            if (in.get() != '{') {
-                reset();
-                return false;
-            }
+        render_task (const engine& eng, std::unique_ptr<detail::render_state> state, bool done) :
+            m_engine{&eng}, m_state{std::move(state)}, m_done{done}
+        {}
 
-            if (in.get() != '%') {
-                reset();
-                return false;
-            }
+        const engine* m_engine;
+        std::unique_ptr<detail::render_state> m_state;
+        bool m_done;
+    };
 
-            while (std::isspace(in.peek())) {
-                in.get();
-            }
+    /// A rendered template which can be brought up to date when its context changes, for pages which
+    /// change a little at a time, like live dashboards.
+    ///
+    /// The template is split into its top-level tags, each `for`, `if` and `cache` block counting as
+    /// one, and the paths in the context which each part read are recorded as it's rendered. After
+    /// changing entities with `context::update` or `context::mark_changed`, `update` re-renders only the
+    /// parts which read them and patches the text, so the cost depends on what changed rather than the
+    /// size of the page. Parts with custom tags are always re-rendered, since what they read isn't known.
+    /// A part with `set` tags which is re-rendered counts as changing the entities they set.
+    ///
+    /// The engine, template and context must outlive the live render, and changes recorded in the context
+    /// are consumed by the first live render to be updated.
+    class live_render {
+    public:
+        /// A range of the text which was replaced by `update`.
+        struct change {
+            std::size_t offset;   ///< Where the range starts, in the updated text.
+            std::size_t removed;  ///< The number of bytes which were replaced.
+            std::size_t inserted; ///< The number of bytes which replaced them.
+        };
 
-            auto id = get_identifier(in);
+        /// The rendered text.
+        auto text() const -> std::string_view { return m_text; }
 
-            if (id == tag) {
-                reset();
-                return true;
+        /// Re-render the parts of the template which read entities changed since the last update,
+        /// and return the ranges of the text which were replaced, in order.
+        /// Parts whose text comes out the same aren't reported.
+        /// \throws `koura::render_error` if the template can't be rendered with the changed context.
+        auto update() -> std::vector<change> {
+            auto changed = m_ctx->take_changes();
+            std::vector<change> changes;
+            std::size_t offset = 0;
+            std::string text;
+
+            for (auto& seg : m_segments) {
+                bool dirty = seg.always_dirty || std::any_of(changed.begin(), changed.end(), [&seg](auto& path) {
+                    return std::any_of(seg.reads.begin(), seg.reads.end(), [&path](auto read) {
+                        return detail::paths_overlap(path, *read);
+                    });
+                });
+
+                if (dirty) {
+                    text.clear();
+                    seg.reads.clear();
+                    m_engine->render_segment(*m_tmpl, seg.begin, seg.end, text, *m_ctx, m_options, seg.reads);
+                    add_writes(seg, changed);
+
+                    if (text != std::string_view{m_text}.substr(offset, seg.size)) {
+                        m_text.replace(offset, seg.size, text);
+                        changes.push_back({offset, seg.size, text.size()});
+                        seg.size = text.size();
+                    }
+                }
+                offset += seg.size;
             }
 
-            reset();
-            return false;
+            return changes;
         }
 
-        void process_tag (engine& eng, std::istream& in, std::ostream& out, context& ctx);
-        void skip_tag (engine& eng, std::istream& in, std::ostream& out, context& ctx);
+    private:
+        friend class engine;
 
-        inline void process_until_tag (engine& eng, std::istream& in, std::ostream& out, context& ctx, std::string_view tag) {
-            while (true) {
-                stream_up_to_tag(in,out);
-                if (is_next_tag(in,tag)) {
-                    return;
-                }
-                process_tag(eng,in,out,ctx);
+        /// A top-level tag or block, and the paths it read when it was last rendered.
+        struct segment {
+            std::size_t begin;
+            std::size_t end;
+            std::size_t size = 0;
+            bool always_dirty = false;
+            std::vector<const std::vector<symbol>*> reads {};
+        };
+
+        live_render (const engine& eng, const compiled_template& tmpl, context& ctx, const render_options& options) :
+            m_engine{&eng}, m_tmpl{&tmpl}, m_ctx{&ctx}, m_options{options}
+        {
+            m_options.pool = nullptr;
+            auto& program = tmpl.m_program.code;
+            for (std::size_t begin = 0; begin < program.size();) {
+                auto& seg = m_segments.emplace_back(segment{begin, detail::top_level_end(program, begin)});
+                seg.always_dirty = std::any_of(program.begin() + seg.begin, program.begin() + seg.end, [](auto& instr) {
+                    return instr.op == detail::opcode::custom;
+                });
+
+                auto before = m_text.size();
+                eng.render_segment(tmpl, seg.begin, seg.end, m_text, ctx, m_options, seg.reads);
+                seg.size = m_text.size() - before;
+                begin = seg.end;
             }
+            //Changes made before now are already reflected in the text
+            ctx.take_changes();
         }
 
-        inline void skip_until_tag (engine& eng, std::istream& in, std::ostream& out, context& ctx, std::string_view tag) {
-            while (true) {
-                skip_up_to_tag(in,out);
-                if (is_next_tag(in,tag)) {
-                    return;
+        /// Record the entities which `set` tags in `seg` changed, so later parts which read them are re-rendered.
+        void add_writes (const segment& seg, std::vector<std::vector<symbol>>& changed) const {
+            for (auto pc = seg.begin; pc < seg.end; ++pc) {
+                auto& instr = m_tmpl->m_program.code[pc];
+                if (instr.op == detail::opcode::set) {
+                    changed.push_back(m_tmpl->m_program.args_of(instr).arg.path);
                 }
-                skip_tag(eng,in,out,ctx);
             }
         }
 
+        const engine* m_engine;
+        const compiled_template* m_tmpl;
+        context* m_ctx;
+        render_options m_options;
+        std::vector<segment> m_segments;
+        std::string m_text;
+    };
 
-        inline void handle_for_expression (engine& eng, std::istream& in, std::ostream& out, context& ctx,
-                                           const std::any& data) {
-            auto loop_var_id = get_identifier(in);
-            expect_text(in, "in");
-            auto ent = parse_entity(in,ctx);
+    inline auto engine::render_live (const compiled_template& tmpl, context& ctx, const render_options& options) const
+        -> live_render {
+        return live_render{*this, tmpl, ctx, options};
+    }
 
-            if (in.get() != '%' || in.get() != '}') {
-                throw render_error{in};
+    inline auto engine::render_async (const compiled_template& tmpl, std::ostream& out, context& ctx,
+                                      const render_options& options) const -> render_task {
+        std::ostream::sentry sentry {out};
+        auto state = std::make_unique<detail::render_state>(tmpl.m_program, tmpl.m_id, tmpl.m_max_loop_depth,
+                                                            out, ctx, options);
+        return render_task{*this, std::move(state), !sentry};
+    }
+
+    /// A template whose text is known when the program is compiled, and which is parsed by the C++ compiler.
+    ///
+    /// `Source` is a type with a `static constexpr std::string_view text()` function, usually declared with
+    /// `KOURA_STATIC_TEMPLATE`. Malformed templates, such as ones with unbalanced `for` and `endfor` tags,
+    /// fail to compile. Rendering is dispatched statically over the parsed instructions, and literal text is
+    /// written straight from the string literal. Paths and filter chains are split into names by the C++
+    /// compiler too, but symbols can only be interned at run time, so the first time each tag is rendered
+    /// its names are interned and kept for later renders.
+    ///
+    /// Static templates support variables, filters, `if`, `unless`, `for`, `set` and `flush` tags.
+    /// The tags in a block are rendered one after another by a single function, so only nesting blocks
+    /// inside each other deepens template instantiation. A tag which reaches a deferred entity blocks until
+    /// its value is available, since a static render can't be suspended and resumed like a `render_task`.
+    template <class Source>
+    class static_template {
+    public:
+        /// Render the template to `out` using the context `ctx` and the filters registered with `eng`.
+        static void render (const engine& eng, std::ostream& out, context& ctx) {
+            std::ostream::sentry sentry {out};
+            if (!sentry) {
+                return;
             }
 
-            auto start_pos = in.tellg();
+            std::pmr::string buffers[2];
+            render_range<0, program.size>(eng, out, ctx, buffers);
+        }
 
-            if (ent.get_type() != entity::type::sequence) {
-                throw render_error{in};
-            }
+    private:
+        static constexpr auto sizes = detail::static_parser<0>{Source::text()}.parse();
+        static constexpr auto program = detail::static_parser<sizes.size, sizes.segment_count, sizes.filter_count>{
+            Source::text()}.parse();
 
-            auto seq = ent.get_value<sequence_t>();
+        /// The run-time form of the arguments of every instruction, which holds their interned names.
+        /// It's built on first use.
+        static auto tags() -> const std::vector<detail::tag_args>& {
+            static const auto args = [] {
+                std::vector<detail::tag_args> built;
+                built.reserve(program.size);
+                for (std::size_t pc = 0; pc < program.size; ++pc) {
+                    built.push_back(detail::to_tag_args(program, program.code[pc]));
+                }
+                return built;
+            }();
+            return args;
+        }
 
-            for (auto&& loop_var : seq) {
-                in.seekg(start_pos);
-                auto ctx_with_loop_var = ctx;
-                ctx_with_loop_var.add_entity(loop_var_id, loop_var);
+        /// Get the end of the `if` chain which starts with the branch at `pc`. The arm before an `elseif` or
+        /// `else` ends with a jump past the chain, where any jump inside the arm stays inside it.
+        static constexpr auto chain_end (std::size_t pc) -> std::size_t {
+            auto next = program.code[pc].jump;
+            auto& last = program.code[next - 1];
+            return last.op == detail::opcode::jump && last.jump > next ? last.jump : next;
+        }
 
-                process_until_tag(eng,in,out,ctx_with_loop_var,"endfor");
+        /// Get the end of the item which starts at `pc`: a whole `for` loop or `if` chain, or else one instruction.
+        static constexpr auto item_end (std::size_t pc) -> std::size_t {
+            switch (program.code[pc].op) {
+            case detail::opcode::loop:
+                return program.code[pc].jump;
+            case detail::opcode::branch:
+                return chain_end(pc);
+            default:
+                return pc + 1;
             }
+        }
 
-            eat_tag(in);
+        static constexpr auto count_items (std::size_t begin, std::size_t end) -> std::size_t {
+            std::size_t count = 0;
+            for (auto pc = begin; pc < end; pc = item_end(pc)) {
+                ++count;
+            }
+            return count;
         }
 
-        inline void handle_unless_expression (engine& eng, std::istream& in, std::ostream& out, context& ctx,
-                                              const std::any& data) {
+        template <std::size_t Begin, std::size_t End>
+        static constexpr auto item_starts() -> std::array<std::size_t, count_items(Begin, End)> {
+            std::array<std::size_t, count_items(Begin, End)> starts {};
+            std::size_t i = 0;
+            for (auto pc = Begin; pc < End; pc = item_end(pc)) {
+                starts[i++] = pc;
+            }
+            return starts;
+        }
 
+        template <std::size_t Begin, std::size_t End>
+        static void render_range (const engine& eng, std::ostream& out, context& ctx, std::pmr::string (&buffers)[2]) {
+            render_items<Begin, End>(eng, out, ctx, buffers, std::make_index_sequence<count_items(Begin, End)>{});
         }
 
-        inline void handle_set_expression (engine& eng, std::istream& in, std::ostream& out, context& ctx,
-                                           const std::any& data) {
-            auto& ent = parse_named_entity(in, ctx);
-            auto val = parse_entity(in, ctx);
+        static constexpr auto straight = static_cast<std::size_t>(-1);
 
-            switch (ent.get_type()) {
-            case koura::entity::type::number:
-                ent.get_value<koura::number_t>() = val.get_value<koura::number_t>();
-                break;
-            case koura::entity::type::text:
-            {
-                ent.get_value<koura::text_t>() = val.get_value<koura::text_t>();
-                auto a = ent.get_value<koura::text_t>();
-                auto b = val.get_value<koura::text_t>();
-                break;
-            }
-            case koura::entity::type::object:
-                ent.get_value<koura::object_t>() = val.get_value<koura::object_t>();
-                break;
-            case koura::entity::type::sequence:
-                //TODO
-                break;
-            }
+        /// Get the `PC` which `render_item` is instantiated with for the item at `pc`. Blocks need their own
+        /// instantiation to dispatch their bodies, but single instructions share one for each opcode, so long
+        /// templates don't instantiate a function for every instruction.
+        static constexpr auto item_pc (std::size_t pc) -> std::size_t {
+            auto op = program.code[pc].op;
+            return op == detail::opcode::branch || op == detail::opcode::loop ? pc : straight;
+        }
 
-            eat_whitespace(in);
-            assert(in.get() == '%');
-            assert(in.get() == '}');
+        template <std::size_t Begin, std::size_t End, std::size_t... Items>
+        static void render_items (const engine& eng, std::ostream& out, context& ctx, std::pmr::string (&buffers)[2],
+                                  std::index_sequence<Items...>) {
+            //Expanding into an initialiser renders the items in order like a fold over `,` would, but GCC
+            //takes time quadratic in the number of items to compile such a fold
+            constexpr auto starts = item_starts<Begin, End>();
+            int in_order[] = {
+                (render_item<program.code[starts[Items]].op, item_pc(starts[Items])>(
+                     starts[Items], eng, out, ctx, buffers), 0)..., 0
+            };
+            (void)in_order;
+            (void)starts;
         }
 
-        inline void handle_if_expression (engine& eng, std::istream& in, std::ostream& out, context& ctx,
-                                          const std::any& data) {
-            bool cond = false;
-            try {
-                auto ent = parse_entity(in, ctx);
-                cond = is_truthy(ent);
+        /// Render the item at `pc`, which is `PC` unless it's a single instruction.
+        template <detail::opcode Op, std::size_t PC>
+        static void render_item (std::size_t pc, const engine& eng, std::ostream& out, context& ctx,
+                                 std::pmr::string (&buffers)[2]) {
+            using detail::opcode;
+
+            if constexpr (Op == opcode::literal) {
+                detail::write_text(out, program.code[pc].text);
             }
-            catch (std::out_of_range& e) {
-                cond = false;
+            else if constexpr (Op == opcode::variable) {
+                render_variable(eng, out, ctx, buffers, tags()[pc]);
             }
+            else if constexpr (Op == opcode::branch) {
+                render_arm<PC, item_end(PC)>(eng, out, ctx, buffers);
+            }
+            else if constexpr (Op == opcode::loop) {
+                constexpr auto& instr = program.code[PC];
+                auto& loop = tags()[PC];
+                entity scratch;
+                auto& ent = awaiting([&]() -> entity& { return detail::resolve_path(loop.arg.path, ctx, scratch); });
+                if (ent.get_type() != entity::type::sequence) {
+                    throw render_error{};
+                }
 
-            eat_whitespace(in);
-            assert(in.get() == '%');
-            assert(in.get() == '}');
-            eat_single_trailing_whitespace(in);
-
-            if (cond) {
-                while (true) {
-                    stream_up_to_tag(in,out);
-                    if (is_next_tag(in, "elseif") || is_next_tag(in, "else")) {
-                        skip_until_tag(eng,in,out,ctx,"endif");
-                    }
-                    else if (is_next_tag(in, "endif")) {
-                        break;
-                    }
-                    else {
-                        process_tag(eng,in,out,ctx);
-                    }
+                //The body runs up to the `end_loop` instruction just before the loop's exit
+                detail::loop_frame frame {loop.name, loop.arg.path, ent, ctx, std::pmr::get_default_resource()};
+                while (frame.next()) {
+                    render_range<PC + 1, instr.jump - 1>(eng, out, frame.scope, buffers);
                 }
             }
-            else {
-                while (true) {
-                    skip_up_to_tag(in,out);
-
-                    //TODO ifelse
+            else if constexpr (Op == opcode::set) {
+                auto& args = tags()[pc];
+                awaiting([&] { detail::assign(args, ctx); });
+            }
+            else if constexpr (Op == opcode::flush) {
+                out.flush();
+            }
+            //A jump ends an arm of an `if` chain, and `render_arm` carries on after the chain anyway
+        }
 
-                    if (is_next_tag(in, "else")) {
-                        eat_tag(in);
-                        while (true) {
-                            stream_up_to_tag(in,out);
-                            if (is_next_tag(in, "endif")) {
-                                break;
-                            }
-                            else {
-                                process_tag(eng,in,out,ctx);
-                            }
-                        }
-                        break;
-                    }
-                    else if (is_next_tag(in, "endif")) {
-                        break;
-                    }
-                    else {
-                        skip_tag(eng,in,out,ctx);
-                    }
+        /// Render the arm of the `if` chain ending at `End` which starts with the branch at `PC`.
+        template <std::size_t PC, std::size_t End>
+        static void render_arm (const engine& eng, std::ostream& out, context& ctx, std::pmr::string (&buffers)[2]) {
+            constexpr auto& instr = program.code[PC];
+            if (evaluate_condition(ctx, tags()[PC]) != instr.negate) {
+                render_range<PC + 1, instr.jump>(eng, out, ctx, buffers);
+            }
+            else if constexpr (instr.jump < End) {
+                //An `elseif` is a branch whose chain ends with this one. An `else` whose body is a single
+                //`if` chain looks the same, and rendering it as an `elseif` gives the same text
+                if constexpr (program.code[instr.jump].op == detail::opcode::branch && chain_end(instr.jump) == End) {
+                    render_arm<instr.jump, End>(eng, out, ctx, buffers);
+                }
+                else {
+                    render_range<instr.jump, End>(eng, out, ctx, buffers);
                 }
             }
-            eat_tag(in);
         }
-    }
-
-    /// The Koura rendering engine.
-    class engine {
-    public:
-        /// The type of a custom expression handler.
-        using expression_handler_t = std::function<void(engine&,std::istream&, std::ostream&,
-                                                        context&, const std::any&)>;
 
-        /// The type of a custom text filter.
-        using filter_t = std::function<std::string(std::string_view, context&)>;
+        //Every variable tag and branch shares these, which keeps the functions rendering blocks small
+        static void render_variable (const engine& eng, std::ostream& out, context& ctx,
+                                     std::pmr::string (&buffers)[2], const detail::tag_args& args) {
+            awaiting([&] { eng.render_variable(args, out, ctx, buffers); });
+        }
 
-        engine() :
-            m_expression_handlers{
-              {"if", std::make_pair(detail::handle_if_expression, nullptr)},
-              {"unless", std::make_pair(detail::handle_unless_expression, nullptr)},
-              {"set", std::make_pair(detail::handle_set_expression, nullptr)},
-              {"for", std::make_pair(detail::handle_for_expression, nullptr)}
-            },
+        static bool evaluate_condition (context& ctx, const detail::tag_args& args) {
+            return awaiting([&] { return detail::evaluate_condition(args.arg, ctx); });
+        }
 
-            m_filters{
-              {"capitalise", filters::capitalise}
+        /// Run `step`, waiting for any deferred entity it reaches and running it again.
+        /// Steps only write their output once every lookup has succeeded, so running one twice is safe.
+        template <class Step>
+        static auto awaiting (Step&& step) -> decltype(step()) {
+            while (true) {
+                try {
+                    return step();
+                }
+                catch (detail::suspension& suspended) {
+                    suspended.pending.wait();
+                }
             }
+        }
+    };
+
+    /// Declare `name` as a `koura::static_template` of the string literal `literal`.
+    /// This can be used at namespace or block scope.
+#define KOURA_STATIC_TEMPLATE(name, literal) \
+    struct name##_source { static constexpr std::string_view text() { return literal; } }; \
+    using name = ::koura::static_template<name##_source>
+
+    /// A cache of compiled templates which can be shared between threads.
+    ///
+    /// Each thread keeps its own view of the cache, so once a thread has seen a template, looking it up
+    /// again takes no locks. Adding or invalidating templates bumps a generation counter, which makes
+    /// every thread refresh its view on its next lookup.
+    ///
+    /// Templates in the cache can include and extend each other by name. Each cached template is linked
+    /// into a single program when it's compiled, and the cache remembers which templates and files went
+    /// into it, so changing one of them only drops the templates which used it.
+    class template_cache {
+    public:
+        /// Create a cache which compiles templates with `eng`, which must outlive the cache.
+        /// Templates which haven't been added to the cache are read from files under `root`. If `root` is empty,
+        /// like `no_loader`, no files are read, and looking up or including a template which hasn't been added
+        /// throws `koura::render_error`.
+        explicit template_cache (const engine& eng, std::filesystem::path root = {}) :
+            m_engine{&eng}, m_root{std::move(root)}
         {}
 
+        /// Compile `text` and add it to the cache under the name `name`, replacing any existing template.
+        /// Cached templates which include or extend `name` are dropped, so they pick up the new text.
+        /// \throws `koura::render_error` if the template is malformed.
+        void add (const std::string& name, std::string_view text) {
+            auto source = std::make_shared<const std::string>(text);
+            while (true) {
+                auto generation = m_generation.load(std::memory_order_acquire);
+                auto compiled = compile(name, source);
 
-        /// Render the text from `in` to `out` using the context `ctx`.
-        void render (std::istream& in, std::ostream& out, context& ctx) {
-            while (in) {
-                detail::stream_up_to_tag(in, out);
-                if (in) {
-                    detail::process_tag(*this, in, out, ctx);
+                //A template it uses may have changed while it was compiled, in which case it's compiled again
+                std::unique_lock lock {m_mutex};
+                if (m_generation.load(std::memory_order_relaxed) != generation) {
+                    continue;
                 }
+                m_sources[name] = std::move(source);
+                drop(name);
+                m_templates[name] = std::move(compiled);
+                m_generation.fetch_add(1, std::memory_order_release);
+                return;
             }
         }
 
+        /// Get the template called `name`. If it isn't in the cache, it's compiled from the file `root / name`.
+        /// Names which are absolute or lead outside of `root`, and every name if `root` is empty, are rejected
+        /// with `koura::render_error`.
+        /// The reference is valid until this thread next calls `get` after the cache has been changed.
+        /// \throws `koura::render_error` if the template is malformed and
+        /// `std::system_error` if the file can't be read.
+        auto get (const std::string& name) -> const compiled_template& {
+            auto& local = local_view();
+            auto generation = m_generation.load(std::memory_order_acquire);
+            if (local.generation != generation) {
+                local.templates.clear();
+                local.generation = generation;
+            }
 
-        /// Register a custom expression handler.
-        void register_custom_expression (std::string_view name, expression_handler_t handler, std::any data) {
-            m_expression_handlers.emplace(std::string{name}, std::make_pair(handler, std::move(data)));
-        }
+            auto it = local.templates.find(name);
+            if (it != local.templates.end()) {
+                return *it->second;
+            }
 
-        /// Register a custom text filter.
-        /// After a filter is registered, it can be used just like a normal filter
-        /// E.g. `eng.register_custom_filter("upcase_even", upcase_even);` `{{thing | upcase_even}}`
-        void register_custom_filter (std::string_view name, filter_t filter) {
-            m_filters.emplace(std::string{name}, filter);
+            auto tmpl = get_shared(name);
+            return *local.templates.emplace(name, std::move(tmpl)).first->second;
         }
 
+        /// Render the template called `name` to `out` using the context `ctx`.
+        void render (const std::string& name, std::ostream& out, context& ctx) {
+            m_engine->render(get(name), out, ctx);
+        }
 
-        inline void handle_variable_tag (std::istream& in, std::ostream& out, context& ctx) {
-            auto ent = detail::parse_named_entity(in, ctx);
-            if (ent.get_type() != entity::type::text && ent.get_type() != entity::type::number) {
-                throw render_error{in};
-            }
+        /// Remove the template called `name` from the cache, along with any templates which include or extend it.
+        void invalidate (const std::string& name) {
+            std::unique_lock lock {m_mutex};
+            m_sources.erase(name);
+            drop(name);
+            m_generation.fetch_add(1, std::memory_order_release);
+        }
 
-            auto text = ent.get_type() == entity::type::text ? ent.get_value<text_t>() : std::to_string(ent.get_value<number_t>());
+        /// Remove all templates from the cache.
+        void clear() {
+            std::unique_lock lock {m_mutex};
+            m_sources.clear();
+            m_templates.clear();
+            m_generation.fetch_add(1, std::memory_order_release);
+        }
 
-            detail::eat_whitespace(in);
+        /// Drop templates whose files, or any files they include or extend, have been modified since they
+        /// were compiled, so they're recompiled from the new files the next time they're used.
+        /// This checks the modification time of every file, so call it periodically rather than per render.
+        /// Returns the number of templates which were dropped.
+        auto refresh() -> std::size_t {
+            std::unique_lock lock {m_mutex};
+            std::size_t dropped = 0;
+            for (auto it = m_templates.begin(); it != m_templates.end();) {
+                auto& deps = it->second.dependencies;
+                auto stale = std::any_of(deps.begin(), deps.end(), [](auto& dep) {
+                    return !dep.path.empty() && modified(dep.path) != dep.modified;
+                });
 
-            while (in.peek() == '|') {
-                in.get();
-                text = handle_filter(in, ctx, text);
-                detail::eat_whitespace(in);
+                if (stale) {
+                    it = m_templates.erase(it);
+                    ++dropped;
+                }
+                else {
+                    ++it;
+                }
             }
 
-            out << text;
-
-            assert(in.get() == '}');
-            assert(in.get() == '}');
+            if (dropped) {
+                m_generation.fetch_add(1, std::memory_order_release);
+            }
+            return dropped;
         }
 
-        void handle_expression_tag (std::istream& in, std::ostream& out, context& ctx) {
-            std::string tag_name;
-            in >> tag_name;
+    private:
+        using template_map = std::unordered_map<std::string, std::shared_ptr<const compiled_template>>;
 
-            if (!m_expression_handlers.count(tag_name)) {
-                throw render_error{in};
-            }
+        /// A template or file which was linked into a cached template.
+        /// Added templates have no path, as they only change through `add` and `invalidate`.
+        struct dependency {
+            std::string name;
+            std::filesystem::path path;
+            std::filesystem::file_time_type modified;
+        };
 
-            auto&& [handler, data] = m_expression_handlers[tag_name];
-            handler(*this,in,out,ctx,data);
-        }
+        struct entry {
+            std::shared_ptr<const compiled_template> tmpl;
+            std::vector<dependency> dependencies;
+        };
 
-        auto handle_filter (std::istream& in, context& ctx, std::string_view text) -> std::string {
-            auto filter_name = detail::get_identifier(in);
+        /// A thread's view of a cache, which only lives as long as the cache it belongs to.
+        struct view {
+            std::weak_ptr<const void> owner;
+            std::uint64_t generation = static_cast<std::uint64_t>(-1);
+            template_map templates;
+        };
 
-            if (!m_filters.count(filter_name)) {
-                throw render_error{in};
+        /// Get this thread's view of the cache.
+        /// The views of destroyed caches are released the next time the thread first uses another cache.
+        auto local_view() -> view& {
+            thread_local std::unordered_map<std::uint64_t, view> views;
+            auto it = views.find(m_id);
+            if (it != views.end()) {
+                return it->second;
             }
 
-            return m_filters[filter_name](text,ctx);
+            for (auto old = views.begin(); old != views.end();) {
+                old = old->second.owner.expired() ? views.erase(old) : std::next(old);
+            }
+            auto& local = views[m_id];
+            local.owner = m_alive;
+            return local;
         }
 
-    private:
-        std::unordered_map<std::string, std::pair<expression_handler_t,std::any>> m_expression_handlers;
-        std::unordered_map<std::string, filter_t> m_filters;
-    };
+        auto get_shared (const std::string& name) -> std::shared_ptr<const compiled_template> {
+            while (true) {
+                std::uint64_t generation;
+                {
+                    std::shared_lock lock {m_mutex};
+                    auto it = m_templates.find(name);
+                    if (it != m_templates.end()) {
+                        return it->second.tmpl;
+                    }
+                    generation = m_generation.load(std::memory_order_relaxed);
+                }
 
-    namespace detail {
-        inline void process_tag (engine& eng, std::istream& in, std::ostream& out, context& ctx) {
-            assert(in.get() == '{');
+                //The template or one it uses may have changed while it was compiled, in which case it's compiled again
+                auto compiled = compile(name, nullptr);
+                std::unique_lock lock {m_mutex};
+                if (m_generation.load(std::memory_order_relaxed) == generation) {
+                    return m_templates.emplace(name, std::move(compiled)).first->second.tmpl;
+                }
+            }
+        }
 
-            auto next = in.get();
+        /// Compile the template called `name` from `source`, or find it as `load` would if `source` is null.
+        auto compile (const std::string& name, std::shared_ptr<const std::string> source) -> entry {
+            entry compiled;
+            template_loader loader = [this, &compiled](std::string_view dep) {
+                return load(std::string{dep}, compiled.dependencies);
+            };
 
-            if (next == '{') {
-                eat_whitespace(in);
-                eng.handle_variable_tag(in,out,ctx);
+            if (!source) {
+                std::shared_lock lock {m_mutex};
+                auto it = m_sources.find(name);
+                if (it != m_sources.end()) {
+                    source = it->second;
+                }
             }
 
-            if (next == '%') {
-                eat_whitespace(in);
-                eng.handle_expression_tag(in,out,ctx);
-                eat_single_trailing_whitespace(in);
+            if (source) {
+                compiled.dependencies.push_back({name, {}, {}});
+                compiled.tmpl = std::make_shared<const compiled_template>(m_engine->compile(*source, loader));
+            }
+            else {
+                //Files are mapped rather than copied, as in `engine::compile_file`
+                auto path = file_path(name);
+                compiled.dependencies.push_back({name, path, modified(path)});
+                compiled.tmpl = std::make_shared<const compiled_template>(m_engine->compile_file(path, loader));
             }
+            return compiled;
         }
 
-        inline void skip_tag (engine& eng, std::istream& in, std::ostream& out, context& ctx) {
-            assert(in.get() == '{');
+        /// Find the text of the template called `name`, preferring ones which have been added to the cache.
+        auto load (const std::string& name, std::vector<dependency>& dependencies)
+            -> std::pair<std::shared_ptr<const void>, std::string_view> {
+            {
+                std::shared_lock lock {m_mutex};
+                auto it = m_sources.find(name);
+                if (it != m_sources.end()) {
+                    dependencies.push_back({name, {}, {}});
+                    return {it->second, *it->second};
+                }
+            }
 
-            auto next = in.get();
+            //Check the time before reading, so a change while the file is read is picked up by the next refresh
+            auto path = file_path(name);
+            dependencies.push_back({name, path, modified(path)});
+            return detail::map_file(path);
+        }
 
-            if (next == '{') {
-                [&]{
-                    while (true) {
-                        while (in.peek() != '}') {
-                            in.get();
-                        }
-                        if (in.peek() == '}') {
-                            return;
-                        }
-                        in.get();
-                    }
-                }();
+        /// Get the file which the template called `name` is read from.
+        /// \throws `koura::render_error` if the cache doesn't read files or `name` leads outside of `root`.
+        auto file_path (const std::string& name) const -> std::filesystem::path {
+            if (m_root.empty()) {
+                throw render_error{};
             }
+            return detail::template_path(m_root, name);
+        }
 
-            else if (next == '%') {
-                eat_whitespace(in);
-                auto id = get_identifier(in);
-                if (is_block_tag(id)) {
-                    skip_until_tag(eng,in,out,ctx,std::string{"end"} + id);
-                    eat_tag(in);
-                }
-                else {
-                    [&]{
-                        while (true) {
-                            while (in.peek() != '%') {
-                                in.get();
-                            }
-                            in.get();
-                            if (in.peek() == '}') {
-                                eat_single_trailing_whitespace(in);
-                                return;
-                            }
-                            in.get();
-                        }
-                    }();
-                }
+        static auto modified (const std::filesystem::path& path) -> std::filesystem::file_time_type {
+            std::error_code ec;
+            return std::filesystem::last_write_time(path, ec);
+        }
+
+        /// Remove `name` and the templates which depend on it. The caller must hold a unique lock.
+        void drop (const std::string& name) {
+            for (auto it = m_templates.begin(); it != m_templates.end();) {
+                auto& deps = it->second.dependencies;
+                auto uses = it->first == name || std::any_of(deps.begin(), deps.end(), [&name](auto& dep) {
+                    return dep.name == name;
+                });
+                it = uses ? m_templates.erase(it) : std::next(it);
             }
         }
-    }
+
+        static auto next_id() -> std::uint64_t {
+            static std::atomic<std::uint64_t> id {0};
+            return id.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        const engine* m_engine;
+        std::filesystem::path m_root;
+        std::uint64_t m_id = next_id();
+        std::shared_ptr<const void> m_alive = std::make_shared<char>();
+        std::shared_mutex m_mutex;
+        std::unordered_map<std::string, entry> m_templates;
+        std::unordered_map<std::string, std::shared_ptr<const std::string>> m_sources;
+        std::atomic<std::uint64_t> m_generation {0};
+    };
 }
 
 #endif
@@ -2,9 +2,19 @@
 #include "catch.hpp"
 
 #include <string>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <memory_resource>
 #include "koura.hpp"
 using namespace koura;
 using namespace std::string_literals;
+using namespace std::string_view_literals;
 
 TEST_CASE("built-in filters", "[builtin_filters]") {
     koura::engine engine{};
@@ -19,7 +29,7 @@ TEST_CASE("built-in filters", "[builtin_filters]") {
     }
 }
 
-std::string change_to_cheese(std::string_view text, koura::context&) {
+std::string change_to_cheese(std::string_view, koura::context&) {
     return "cheese";
 }
 
@@ -35,6 +45,13 @@ TEST_CASE("custom filters", "[custom_filters]") {
         engine.render(ss, out, ctx);
         REQUIRE( out.str() == "Hello cheese" );
     }
+
+    SECTION ("built-in filters as custom filters") {
+        engine.register_custom_filter("shout", koura::filters::capitalise);
+        std::stringstream ss {"Hello {{what|shout}}"s};
+        engine.render(ss, out, ctx);
+        REQUIRE( out.str() == "Hello WORLD" );
+    }
 }
 
 TEST_CASE("for", "[for]") {
@@ -68,6 +85,36 @@ TEST_CASE("set tags", "[set]") {
     std::stringstream ss {"{% set what 'jim' %}\nHello {{what}}"s};
     engine.render(ss, out, ctx);
     REQUIRE( out.str() == "Hello jim" );
+
+    SECTION ("loop variables") {
+        //Loop variables refer to the caller's elements, so setting them would change the caller's data
+        koura::object_t row;
+        row["name"] = koura::text_t{"alice"};
+        ctx.add_entity("names", koura::sequence_t{koura::text_t{"bob"}});
+        ctx.add_entity("rows", koura::sequence_t{row});
+        REQUIRE_THROWS_AS( engine.render("{% for name in names %}{% set name 'x' %}{% endfor %}"sv, out, ctx),
+                           koura::render_error );
+        REQUIRE_THROWS_AS( engine.render("{% for row in rows %}{% set row.name 'x' %}{% endfor %}"sv, out, ctx),
+                           koura::render_error );
+        REQUIRE( ctx.get_entity("names").get_value<koura::sequence_t>()[0].get_value<koura::text_t>() == "bob" );
+        auto& rows = ctx.get_entity("rows").get_value<koura::sequence_t>();
+        REQUIRE( rows[0].get_value<koura::object_t>()[koura::symbol{"name"}].get_value<koura::text_t>() == "alice" );
+
+        //Replacing the sequence a loop is iterating over would leave the loop reading freed elements
+        ctx.add_entity("others", koura::sequence_t{koura::text_t{"x"}, koura::text_t{"y"}});
+        REQUIRE_THROWS_AS( engine.render("{% for name in names %}{% set names others %}{{name}}{% endfor %}"sv, out, ctx),
+                           koura::render_error );
+        REQUIRE_THROWS_AS( engine.render("{% for name in names %}{% for o in others %}{% set names others %}"
+                                         "{% endfor %}{% endfor %}"sv, out, ctx),
+                           koura::render_error );
+        REQUIRE( ctx.get_entity("names").get_value<koura::sequence_t>().size() == 1 );
+
+        std::stringstream outer;
+        engine.render("{% for name in names %}{% set others names %}{% endfor %}"sv, outer, ctx);
+        REQUIRE( ctx.get_entity("others").get_value<koura::sequence_t>().size() == 1 );
+        engine.render("{% for name in names %}{% set what name %}{% endfor %}{{what}}"sv, outer, ctx);
+        REQUIRE( outer.str() == "bob" );
+    }
 }
 
 TEST_CASE("object access", "[object-access]") {
@@ -134,3 +181,1264 @@ TEST_CASE("if", "[if]") {
         REQUIRE( out.str() == "lol\n" );
     }
 }
+
+TEST_CASE("compiled templates", "[compile]") {
+    koura::engine engine{};
+    std::stringstream ss {"{% for name in names %}{% if name %}Hello {{name|capitalise}}\n{% endif %}{% endfor %}{{what.name}}"s};
+    auto tmpl = engine.compile(ss);
+
+    koura::object_t what;
+    what["name"] = koura::text_t{"world"};
+
+    SECTION ("render twice") {
+        for (auto&& expected : {"Hello ALICE\nHello BOB\nworld"s, "Hello ALICE\nHello BOB\nworld"s}) {
+            koura::context ctx{};
+            ctx.add_entity("names", koura::sequence_t{koura::text_t{"alice"}, koura::text_t{"bob"}});
+            ctx.add_entity("what", what);
+            std::stringstream out;
+            engine.render(tmpl, out, ctx);
+            REQUIRE( out.str() == expected );
+        }
+    }
+
+    SECTION ("different contexts") {
+        koura::context ctx{};
+        ctx.add_entity("names", koura::sequence_t{});
+        ctx.add_entity("what", what);
+        std::stringstream out;
+        engine.render(tmpl, out, ctx);
+        REQUIRE( out.str() == "world" );
+    }
+
+    SECTION ("else branches") {
+        std::stringstream src {"{% if a %}a{% elseif b %}b{% else %}c{% endif %}{% unless a %}!{% endunless %}"s};
+        auto branches = engine.compile(src);
+        koura::context ctx{};
+        ctx.add_entity("b", koura::number_t{1});
+        std::stringstream out;
+        engine.render(branches, out, ctx);
+        REQUIRE( out.str() == "b!" );
+    }
+
+    SECTION ("unbalanced blocks") {
+        std::stringstream src {"{% for name in names %}{{name}}"s};
+        REQUIRE_THROWS_AS( engine.compile(src), koura::render_error );
+    }
+}
+
+namespace {
+    class unseekable_buf : public std::stringbuf {
+    public:
+        using std::stringbuf::stringbuf;
+
+    protected:
+        pos_type seekoff(off_type, std::ios_base::seekdir, std::ios_base::openmode) override { return pos_type(off_type(-1)); }
+        pos_type seekpos(pos_type, std::ios_base::openmode) override { return pos_type(off_type(-1)); }
+    };
+}
+
+TEST_CASE("non-seekable input", "[unseekable]") {
+    koura::engine engine{};
+    koura::context ctx{};
+    ctx.add_entity("names", koura::sequence_t{koura::text_t{"alice"}, koura::text_t{"bob"}});
+    std::stringstream out;
+
+    unseekable_buf buf {"{% for name in names %}{% if name %}Hello {{name}}\n{% endif %}{% endfor %}"s};
+    std::istream in {&buf};
+    engine.render(in, out, ctx);
+    REQUIRE( out.str() == "Hello alice\nHello bob\n" );
+}
+
+TEST_CASE("custom expressions", "[custom_expressions]") {
+    koura::engine engine{};
+    koura::context ctx{};
+    ctx.add_entity("what", "world");
+    std::stringstream out;
+
+    engine.register_custom_expression("shout", [](const koura::engine&, std::istream& in, std::ostream& out,
+                                                  koura::context& ctx, const std::any&) {
+        auto ent = koura::detail::parse_entity(in, ctx);
+        out << ent.get_value<koura::text_t>() << '!';
+    }, {});
+
+    std::stringstream ss {"{% for i in is %}{% shout what %}{% endfor %}"s};
+    ctx.add_entity("is", koura::sequence_t{koura::number_t{1}, koura::number_t{2}});
+    engine.render(ss, out, ctx);
+    REQUIRE( out.str() == "world!world!" );
+
+    SECTION ("block tags") {
+        //The handler gets the rest of its tag, its body and its closing tag, as the stream interpreter gave it
+        engine.register_custom_block("twice", [](const koura::engine& eng, std::istream& in, std::ostream& out,
+                                                 koura::context& ctx, const std::any&) {
+            auto block = koura::detail::read_all(in);
+            auto body = block.substr(block.find("%}") + 2);
+            body.erase(body.rfind("{%"));
+            eng.render(std::string_view{body + body}, out, ctx);
+        }, {});
+
+        auto tmpl = engine.compile("<{% twice %}{{what}}{% twice %}.{% endtwice %}{% endtwice %}>"sv);
+        std::stringstream block_out;
+        engine.render(tmpl, block_out, ctx);
+        REQUIRE( block_out.str() == "<world..world..>" );
+    }
+
+    SECTION ("stream entry points") {
+        ctx.add_entity("names", koura::sequence_t{koura::text_t{"a"}, koura::text_t{"b"}});
+        std::stringstream tag_out;
+
+        std::istringstream variable {" what | upper }}rest"};
+        engine.handle_variable_tag(variable, tag_out, ctx);
+        REQUIRE( tag_out.str() == "WORLD" );
+        REQUIRE( koura::detail::read_all(variable) == "rest" );
+
+        std::istringstream expression {" for n in names %}{% for m in names %}{{n}}{{m}}{% endfor %}{% endfor %}rest"};
+        engine.handle_expression_tag(expression, tag_out, ctx);
+        REQUIRE( tag_out.str() == "WORLDaaabbabb" );
+        REQUIRE( koura::detail::read_all(expression) == "rest" );
+
+        std::istringstream custom {" shout what %}rest"};
+        engine.handle_expression_tag(custom, tag_out, ctx);
+        REQUIRE( tag_out.str() == "WORLDaaabbabbworld!" );
+
+        std::istringstream upper {"upper"}, fixed {"fixed: 2"}, missing {"nope"};
+        REQUIRE( engine.handle_filter(upper, ctx, "abc") == "ABC" );
+        REQUIRE( engine.handle_filter(fixed, ctx, "3") == "3.00" );
+        REQUIRE_THROWS_AS( engine.handle_filter(missing, ctx, "abc"), koura::render_error );
+    }
+}
+
+TEST_CASE("scoped contexts", "[scopes]") {
+    koura::context ctx{};
+    ctx.add_entity("what", "world");
+    ctx.add_entity("name", "jim");
+
+    auto scope = ctx.new_scope();
+    koura::entity bob {koura::text_t{"bob"}};
+    scope.bind_entity("name", bob);
+
+    REQUIRE( scope.get_entity("what").get_value<koura::text_t>() == "world" );
+    REQUIRE( scope.get_entity("name").get_value<koura::text_t>() == "bob" );
+    REQUIRE( ctx.get_entity("name").get_value<koura::text_t>() == "jim" );
+    REQUIRE_FALSE( scope.contains("dennis") );
+    REQUIRE_THROWS_AS( scope.get_entity("dennis"), std::out_of_range );
+
+    SECTION ("nested loops") {
+        koura::engine engine{};
+        ctx.add_entity("rows", koura::sequence_t{koura::text_t{"a"}, koura::text_t{"b"}});
+        ctx.add_entity("cols", koura::sequence_t{koura::number_t{1}, koura::number_t{2}});
+        std::stringstream out;
+
+        std::stringstream ss {"{% for name in rows %}{% for col in cols %}{{name}}{{col}} {% endfor %}{% endfor %}{{name}}"s};
+        engine.render(ss, out, ctx);
+        REQUIRE( out.str() == "a1 a2 b1 b2 jim" );
+    }
+}
+
+namespace {
+    struct customer {
+        std::string name;
+        long id;
+    };
+
+    struct line_item {
+        std::string product;
+        int quantity;
+    };
+
+    struct order {
+        customer buyer;
+        std::vector<line_item> items;
+    };
+}
+
+template <>
+struct koura::binding<customer> {
+    static inline const auto fields = koura::bind(&customer::name, "name").bind(&customer::id, "id");
+};
+
+template <>
+struct koura::binding<line_item> {
+    static inline const auto fields = koura::bind(&line_item::product, "product").bind(&line_item::quantity, "quantity");
+};
+
+template <>
+struct koura::binding<order> {
+    static inline const auto fields = koura::bind(&order::buyer, "customer").bind(&order::items, "items");
+};
+
+TEST_CASE("bound user types", "[binding]") {
+    koura::engine engine{};
+    koura::context ctx{};
+    order o {{"jim", 42}, {{"cheese", 2}, {"wine", 1}}};
+    ctx.add_entity("order", koura::ref(o));
+    std::stringstream out;
+
+    SECTION ("fields") {
+        std::stringstream ss {"{{order.customer.name|capitalise}} #{{order.customer.id}}"s};
+        engine.render(ss, out, ctx);
+        REQUIRE( out.str() == "JIM #42" );
+    }
+
+    SECTION ("reads in place") {
+        std::stringstream ss {"{{order.customer.name}}"s};
+        auto tmpl = engine.compile(ss);
+        o.buyer.name = "dennis";
+        engine.render(tmpl, out, ctx);
+        REQUIRE( out.str() == "dennis" );
+    }
+
+    SECTION ("sequences") {
+        std::stringstream ss {"{% for item in order.items %}{{item.quantity}}x {{item.product}}\n{% endfor %}"s};
+        engine.render(ss, out, ctx);
+        REQUIRE( out.str() == "2x cheese\n1x wine\n" );
+    }
+
+    SECTION ("unknown fields") {
+        std::stringstream ss {"{{order.customer.age}}"s};
+        REQUIRE_THROWS_AS( engine.render(ss, out, ctx), koura::render_error );
+    }
+}
+
+TEST_CASE("symbols", "[symbols]") {
+    koura::symbol a {"name"};
+    koura::symbol b {"name"s};
+    koura::symbol c {"what"};
+
+    REQUIRE( a == b );
+    REQUIRE( a != c );
+    REQUIRE( a.name() == "name" );
+    REQUIRE( koura::symbol{}.name() == "" );
+
+    koura::object_t obj;
+    obj["name"] = koura::text_t{"world"};
+    REQUIRE( obj.begin()->first.name() == "name" );
+    REQUIRE( obj.count(a) );
+
+    SECTION ("lookups don't intern") {
+        koura::context ctx{};
+        ctx.add_entity(a, koura::text_t{"world"});
+        REQUIRE( koura::symbol::find("name") == a );
+        REQUIRE( ctx.get_entity("name"sv).get_value<koura::text_t>() == "world" );
+        REQUIRE( ctx.contains("name"s) );
+
+        REQUIRE( !koura::symbol::find("koura_never_interned") );
+        REQUIRE( !ctx.contains("koura_never_interned") );
+        REQUIRE( ctx.find_entity("koura_never_interned"s) == nullptr );
+        REQUIRE_THROWS_AS( ctx.get_entity("koura_never_interned"sv), std::out_of_range );
+        REQUIRE( !koura::symbol::find("koura_never_interned") );
+    }
+}
+
+TEST_CASE("literal text", "[literals]") {
+    koura::engine engine{};
+    koura::context ctx{};
+    ctx.add_entity("what", "world");
+    std::stringstream out;
+
+    SECTION ("lone braces") {
+        std::stringstream ss {"{ a } {x}} Hello {{what}} {"s};
+        engine.render(ss, out, ctx);
+        REQUIRE( out.str() == "{ a } {x}} Hello world {" );
+    }
+
+    SECTION ("large text") {
+        std::string page (100000, 'x');
+        std::stringstream ss {page + "{{what}}" + page};
+        engine.render(ss, out, ctx);
+        REQUIRE( out.str() == page + "world" + page );
+    }
+}
+
+TEST_CASE("template sources", "[sources]") {
+    koura::engine engine{};
+    koura::context ctx{};
+    ctx.add_entity("what", "world");
+    std::stringstream out;
+
+    SECTION ("string view") {
+        engine.render("Hello {{what}}"sv, out, ctx);
+        REQUIRE( out.str() == "Hello world" );
+    }
+
+    SECTION ("compiled string view") {
+        std::string text {"Hello {{what}}"};
+        auto tmpl = engine.compile(std::string_view{text});
+        text = "Goodbye";
+        engine.render(tmpl, out, ctx);
+        REQUIRE( out.str() == "Hello world" );
+    }
+
+    SECTION ("file") {
+        auto path = std::filesystem::temp_directory_path() / "koura_test_template.txt";
+        {
+            std::ofstream file {path};
+            file << "{% for i in is %}Hello {{what}}\n{% endfor %}";
+        }
+        ctx.add_entity("is", koura::sequence_t{koura::number_t{1}, koura::number_t{2}});
+
+        auto tmpl = engine.compile_file(path);
+        std::filesystem::remove(path);
+        engine.render(tmpl, out, ctx);
+        REQUIRE( out.str() == "Hello world\nHello world\n" );
+    }
+
+    SECTION ("missing file") {
+        REQUIRE_THROWS_AS( engine.compile_file("/koura/no/such/template"), std::system_error );
+    }
+}
+
+TEST_CASE("template cache", "[template_cache]") {
+    koura::engine engine{};
+    koura::template_cache cache{engine};
+    cache.add("greeting", "{% for name in names %}Hello {{name}}\n{% endfor %}");
+
+    SECTION ("shared between threads") {
+        std::vector<std::string> results (8);
+        std::vector<std::thread> threads;
+        for (std::size_t i = 0; i < results.size(); ++i) {
+            threads.emplace_back([&cache, &result = results[i], i] {
+                koura::context ctx{};
+                ctx.add_entity("names", koura::sequence_t{koura::text_t{"alice"}, koura::number_t{static_cast<int>(i)}});
+                for (int n = 0; n < 100; ++n) {
+                    std::stringstream out;
+                    cache.render("greeting", out, ctx);
+                    result = out.str();
+                }
+            });
+        }
+        for (auto&& thread : threads) {
+            thread.join();
+        }
+
+        for (std::size_t i = 0; i < results.size(); ++i) {
+            REQUIRE( results[i] == "Hello alice\nHello " + std::to_string(i) + "\n" );
+        }
+    }
+
+    SECTION ("replacing templates") {
+        koura::context ctx{};
+        ctx.add_entity("names", koura::sequence_t{koura::text_t{"alice"}});
+        std::stringstream out;
+        cache.render("greeting", out, ctx);
+        REQUIRE( out.str() == "Hello alice\n" );
+
+        //This thread already has a view of the cache, which must see the new template
+        cache.add("greeting", "Bye {% for name in names %}{{name}}{% endfor %}");
+        std::stringstream again;
+        cache.render("greeting", again, ctx);
+        REQUIRE( again.str() == "Bye alice" );
+
+        std::string other;
+        std::thread reader {[&cache, &ctx, &other] {
+            std::stringstream out;
+            cache.render("greeting", out, ctx);
+            other = out.str();
+        }};
+        reader.join();
+        REQUIRE( other == "Bye alice" );
+
+        cache.invalidate("greeting");
+        REQUIRE_THROWS_AS( cache.get("greeting"), koura::render_error );
+    }
+}
+
+namespace {
+    class counting_resource : public std::pmr::memory_resource {
+    public:
+        std::size_t allocated = 0;
+        std::size_t live = 0;
+
+    private:
+        void* do_allocate(std::size_t bytes, std::size_t align) override {
+            ++allocated;
+            ++live;
+            return std::pmr::new_delete_resource()->allocate(bytes, align);
+        }
+
+        void do_deallocate(void* p, std::size_t bytes, std::size_t align) override {
+            --live;
+            std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+    };
+}
+
+TEST_CASE("render arena", "[arena]") {
+    koura::engine engine{};
+    koura::context ctx{};
+    ctx.add_entity("names", koura::sequence_t{koura::text_t{"alice"}, koura::text_t{"bob"}});
+    std::stringstream out;
+
+    counting_resource upstream;
+    koura::render_options options;
+    options.upstream = &upstream;
+
+    SECTION ("small renders stay on the stack") {
+        auto tmpl = engine.compile("{% for name in names %}{{name|capitalise}}{% endfor %}"sv);
+        engine.render(tmpl, out, ctx, options);
+        REQUIRE( out.str() == "ALICEBOB" );
+        REQUIRE( upstream.allocated == 0 );
+    }
+
+    SECTION ("the arena is released when the render returns") {
+        ctx.add_entity("long", koura::text_t(4096, 'x'));
+        auto tmpl = engine.compile("{% for name in names %}{{long|capitalise}}{% endfor %}"sv);
+        engine.render(tmpl, out, ctx, options);
+        REQUIRE( out.str() == std::string(8192, 'X') );
+        REQUIRE( upstream.allocated > 0 );
+        REQUIRE( upstream.live == 0 );
+    }
+
+    SECTION ("nested loops use constant memory") {
+        //Every inner loop starts a new scope, which mustn't take more of the arena each time
+        auto tmpl = engine.compile("{% for row in rows %}{% for name in names %}{{name}}{% endfor %}{% endfor %}"sv);
+        auto allocated = [&](int rows) {
+            ctx.add_entity("rows", koura::sequence_t(rows, koura::entity{koura::number_t{0}}));
+            counting_resource counted;
+            koura::render_options counted_options;
+            counted_options.upstream = &counted;
+            std::stringstream rows_out;
+            engine.render(tmpl, rows_out, ctx, counted_options);
+            return counted.allocated;
+        };
+        REQUIRE( allocated(10'000) == allocated(10) );
+    }
+}
+
+TEST_CASE("streaming filters", "[stream_filters]") {
+    koura::engine engine{};
+    koura::context ctx{};
+    ctx.add_entity("what", "world");
+    ctx.add_entity("num", koura::number_t{42});
+    std::stringstream out;
+
+    engine.register_stream_filter("reverse", [](std::string_view text, std::pmr::string& out, koura::context&) {
+        out.append(text.rbegin(), text.rend());
+    });
+    engine.register_stream_filter("bracket", [](std::string_view text, std::pmr::string& out, koura::context&) {
+        out += '[';
+        out += text;
+        out += ']';
+    });
+    engine.register_custom_filter("change_to_cheese", change_to_cheese);
+
+    SECTION ("chains") {
+        engine.render("{{what|reverse|capitalise|bracket}} {{num|reverse|bracket}}"sv, out, ctx);
+        REQUIRE( out.str() == "[DLROW] [24]" );
+    }
+
+    SECTION ("mixed with custom filters") {
+        engine.render("{{what|bracket|change_to_cheese|capitalise}}"sv, out, ctx);
+        REQUIRE( out.str() == "CHEESE" );
+    }
+}
+
+TEST_CASE("text filters", "[text_filters]") {
+    koura::engine engine{};
+    koura::context ctx{};
+    std::stringstream out;
+
+    SECTION ("case") {
+        ctx.add_entity("what", "Hello, World!");
+        engine.render("{{what|upper}} {{what|lower}}"sv, out, ctx);
+        REQUIRE( out.str() == "HELLO, WORLD! hello, world!" );
+    }
+
+    SECTION ("escape_html") {
+        ctx.add_entity("what", "<a href=\"x\">Tom & Jerry's</a>");
+        engine.render("{{what|escape_html}}"sv, out, ctx);
+        REQUIRE( out.str() == "&lt;a href=&quot;x&quot;&gt;Tom &amp; Jerry&#39;s&lt;/a&gt;" );
+    }
+
+    SECTION ("escape_url") {
+        ctx.add_entity("what", "a b&c/d~e_f.g-h");
+        engine.render("{{what|escape_url}}"sv, out, ctx);
+        REQUIRE( out.str() == "a%20b%26c%2Fd~e_f.g-h" );
+    }
+
+    SECTION ("escape_json") {
+        ctx.add_entity("what", "say \"hi\"\\\n\x01");
+        engine.render("{{what|escape_json}}"sv, out, ctx);
+        REQUIRE( out.str() == "say \\\"hi\\\"\\\\\\n\\u0001" );
+    }
+
+    SECTION ("trim") {
+        ctx.add_entity("what", " \t hello world \n");
+        engine.render("[{{what|trim}}]"sv, out, ctx);
+        REQUIRE( out.str() == "[hello world]" );
+    }
+
+    SECTION ("vectorised paths match scalar") {
+        using koura::detail::simd::level;
+        using filter_fn = void(*)(std::string_view, std::pmr::string&, level);
+        std::string alphabet = "abcXYZ09 <>&\"'\\/%~-_.\n\x01\xe9";
+
+        std::vector<level> levels {level::scalar};
+        if (koura::detail::simd::best_level() != level::scalar) levels.push_back(level::sse2);
+        if (koura::detail::simd::best_level() == level::avx2) levels.push_back(level::avx2);
+
+        for (filter_fn filter : {filter_fn{koura::detail::simd::upper}, filter_fn{koura::detail::simd::lower},
+                                 filter_fn{koura::detail::simd::escape_html}, filter_fn{koura::detail::simd::escape_url},
+                                 filter_fn{koura::detail::simd::escape_json}}) {
+            for (std::size_t len = 0; len < 200; ++len) {
+                //Odd lengths are dense with characters which need escaping, so blocks have several matches
+                std::string text;
+                for (std::size_t i = 0; i < len; ++i) {
+                    text += (i * 7 + len) % 5 && len % 2 == 0 ? 'q' : alphabet[(i * 13 + len) % alphabet.size()];
+                }
+
+                std::pmr::string expected;
+                filter(text, expected, level::scalar);
+                for (auto lvl : levels) {
+                    std::pmr::string got;
+                    filter(text, got, lvl);
+                    REQUIRE( got == expected );
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("generators", "[generators]") {
+    koura::engine engine{};
+    koura::context ctx{};
+    std::stringstream out;
+    auto tmpl = engine.compile("{% for row in rows %}{{row.id}},{% endfor %}"sv);
+
+    SECTION ("callback") {
+        int produced = 0;
+        ctx.add_entity("rows", koura::generator{[&produced](koura::entity& out) {
+            if (produced == 1000) {
+                return false;
+            }
+            koura::object_t row;
+            row["id"] = koura::number_t{produced++};
+            out = std::move(row);
+            return true;
+        }});
+
+        engine.render(tmpl, out, ctx);
+        std::string expected;
+        for (int i = 0; i < 1000; ++i) {
+            expected += std::to_string(i) + ",";
+        }
+        REQUIRE( out.str() == expected );
+    }
+
+    SECTION ("iterator range") {
+        std::vector<koura::object_t> rows (3);
+        for (int i = 0; i < 3; ++i) {
+            rows[i]["id"] = koura::number_t{i};
+        }
+        ctx.add_entity("rows", koura::generator{rows.begin(), rows.end()});
+        engine.render(tmpl, out, ctx);
+        REQUIRE( out.str() == "0,1,2," );
+
+        std::stringstream again;
+        engine.render(tmpl, again, ctx);
+        REQUIRE( again.str() == "" );
+    }
+}
+
+TEST_CASE("output sinks", "[sinks]") {
+    koura::engine engine{};
+    koura::context ctx{};
+    ctx.add_entity("what", "world");
+    std::vector<std::string> chunks;
+    koura::output_sink sink {[&chunks](std::string_view chunk) { chunks.emplace_back(chunk); }, 8};
+
+    SECTION ("size threshold") {
+        engine.render(engine.compile("Hello {{what}}, hello again"sv), sink, ctx);
+        REQUIRE( chunks == std::vector<std::string>{"Hello ", "world", ", hello again"} );
+    }
+
+    SECTION ("flush tag") {
+        engine.render(engine.compile("<head>{% flush %}\n{{what}}"sv), sink, ctx);
+        REQUIRE( chunks == std::vector<std::string>{"<head>", "world"} );
+    }
+
+    SECTION ("through a stream") {
+        std::ostream out {&sink};
+        out << "abc" << 42;
+        REQUIRE( chunks.empty() );
+        out.flush();
+        REQUIRE( chunks == std::vector<std::string>{"abc42"} );
+    }
+}
+
+TEST_CASE("async rendering", "[async]") {
+    koura::engine engine{};
+    koura::context ctx{};
+    std::stringstream out;
+
+    SECTION ("suspends on unavailable data") {
+        std::promise<koura::entity> user, orders;
+        ctx.add_entity("user", koura::deferred{user.get_future()});
+        ctx.add_entity("orders", koura::deferred{orders.get_future()});
+        auto tmpl = engine.compile("Hello {{user.name}}!\n{% for order in orders %}[{{order}}]{% endfor %}"sv);
+
+        auto task = engine.render_async(tmpl, out, ctx);
+        REQUIRE( !task.resume() );
+        REQUIRE( !task.ready() );
+        REQUIRE( out.str() == "Hello " );
+
+        koura::object_t name;
+        name["name"] = koura::text_t{"Ada"};
+        user.set_value(std::move(name));
+        REQUIRE( task.ready() );
+        REQUIRE( !task.resume() );
+        REQUIRE( out.str() == "Hello Ada!\n" );
+
+        orders.set_value(koura::sequence_t{1, 2});
+        REQUIRE( task.resume() );
+        REQUIRE( task.done() );
+        REQUIRE( out.str() == "Hello Ada!\n[1][2]" );
+    }
+
+    SECTION ("slow lookups overlap") {
+        //Each lookup waits until every lookup has started, which can only happen if they run at the same time
+        std::mutex mutex;
+        std::condition_variable started_cv;
+        int started = 0;
+        std::atomic<int> overlapped {0};
+        auto slow_backend = [&](int value) {
+            return [&, value] {
+                std::unique_lock lock {mutex};
+                ++started;
+                started_cv.notify_all();
+                if (started_cv.wait_for(lock, std::chrono::seconds{10}, [&] { return started == 3; })) {
+                    ++overlapped;
+                }
+                return koura::entity{value};
+            };
+        };
+
+        ctx.add_entity("a", koura::defer(slow_backend(1)));
+        ctx.add_entity("b", koura::defer(slow_backend(2)));
+        ctx.add_entity("c", koura::defer(slow_backend(3)));
+        engine.render(engine.compile("{{a}}{{b}}{{c}}"sv), out, ctx);
+
+        REQUIRE( out.str() == "123" );
+        REQUIRE( overlapped == 3 );
+    }
+
+    SECTION ("errors from the backend") {
+        ctx.add_entity("a", koura::defer([]() -> koura::entity { throw std::runtime_error{"backend down"}; }));
+        auto tmpl = engine.compile("{{a}}"sv);
+        auto task = engine.render_async(tmpl, out, ctx);
+        REQUIRE_THROWS_AS( task.finish(), std::runtime_error );
+    }
+}
+
+TEST_CASE("parallel rendering", "[parallel]") {
+    koura::engine engine{};
+    koura::context ctx{};
+    koura::thread_pool pool{4};
+    koura::render_options options;
+    options.pool = &pool;
+
+    koura::sequence_t rows;
+    for (int i = 0; i < 100; ++i) {
+        rows.emplace_back(koura::number_t{i});
+    }
+    ctx.add_entity("rows", std::move(rows));
+    ctx.add_entity("title", "Report");
+
+    auto render = [&](std::string_view text, const koura::render_options& opts) {
+        std::stringstream out;
+        engine.render(engine.compile(text), out, ctx, opts);
+        return out.str();
+    };
+
+    SECTION ("matches a sequential render") {
+        std::string text = "<h1>{{title}}</h1>\n";
+        for (int i = 0; i < 8; ++i) {
+            text += "<ul>{% for row in rows %}<li>{{row}}</li>{% endfor %}</ul>\n"
+                    "{% if title %}" + std::to_string(i) + "{% else %}none{% endif %}";
+        }
+
+        auto expected = render(text, {});
+        REQUIRE( render(text, options) == expected );
+        REQUIRE( expected.find("<li>99</li></ul>\n7") != std::string::npos );
+    }
+
+    SECTION ("set tags are barriers") {
+        auto text = "{% for row in rows %}{{title}}{% endfor %}\n{% set title 'Done' %}\n{% for row in rows %}{{title}}{% endfor %}"sv;
+        auto expected = render(text, {});
+        ctx.get_entity("title") = koura::text_t{"Report"};
+        REQUIRE( render(text, options) == expected );
+    }
+
+    SECTION ("errors") {
+        auto text = "{% for row in rows %}{{row}}{% endfor %}{% for row in title %}{% endfor %}{{title}}"sv;
+        REQUIRE_THROWS_AS( render(text, options), koura::render_error );
+    }
+}
+
+TEST_CASE("template inheritance", "[inheritance]") {
+    koura::engine engine{};
+    koura::template_cache cache{engine};
+    koura::context ctx{};
+    ctx.add_entity("title", "Home");
+    ctx.add_entity("items", koura::sequence_t{koura::number_t{1}, koura::number_t{2}});
+    std::stringstream out;
+
+    cache.add("nav", "<nav>{{title}}</nav>");
+    cache.add("base", "<html>{% include 'nav' %}{% block content %}default{% endblock %}"
+                      "<footer>{% block footer %}(c){% endblock footer %}</footer></html>");
+
+    SECTION ("include") {
+        cache.add("page", "{% for i in items %}{% include 'nav' %}{% endfor %}");
+        cache.render("page", out, ctx);
+        REQUIRE( out.str() == "<nav>Home</nav><nav>Home</nav>" );
+    }
+
+    SECTION ("extends") {
+        cache.add("page", "{% extends 'base' %}ignored{% block content %}{% for i in items %}[{{i}}]{% endfor %}{% endblock %}");
+        cache.render("page", out, ctx);
+        REQUIRE( out.str() == "<html><nav>Home</nav>[1][2]<footer>(c)</footer></html>" );
+    }
+
+    SECTION ("multiple levels") {
+        cache.add("layout", "{% extends 'base' %}{% block content %}<main>{% block main %}{% endblock %}</main>{% endblock %}");
+        cache.add("page", "{% extends 'layout' %}{% block main %}{{title}}{% endblock %}{% block footer %}none{% endblock %}");
+        cache.render("page", out, ctx);
+        REQUIRE( out.str() == "<html><nav>Home</nav><main>Home</main><footer>none</footer></html>" );
+    }
+
+    SECTION ("changing a dependency") {
+        cache.add("page", "{% extends 'base' %}");
+        cache.render("page", out, ctx);
+        cache.add("nav", "<nav/>");
+        std::stringstream again;
+        cache.render("page", again, ctx);
+        REQUIRE( again.str() == "<html><nav/>default<footer>(c)</footer></html>" );
+    }
+
+    SECTION ("errors") {
+        auto text = std::make_shared<const std::string>("{% include 'self' %}");
+        koura::template_loader loader = [&text](std::string_view) { return std::make_pair(text, std::string_view{*text}); };
+        REQUIRE_THROWS_AS( engine.compile(*text, loader), koura::render_error );
+        REQUIRE_THROWS_AS( cache.add("c", "{% block x %}{% endblock y %}"), koura::render_error );
+        REQUIRE_THROWS_AS( cache.add("d", "{% include title %}"), koura::render_error );
+    }
+
+    SECTION ("files are only read when asked") {
+        REQUIRE_THROWS_AS( engine.compile("{% include 'koura.hpp' %}"), koura::render_error );
+        REQUIRE_THROWS_AS( engine.compile("{% extends 'koura.hpp' %}"), koura::render_error );
+        REQUIRE_THROWS_AS( engine.render("{% include 'koura.hpp' %}", out, ctx), koura::render_error );
+
+        //A cache without a root only has the templates it's given
+        REQUIRE_THROWS_AS( cache.get("koura.hpp"), koura::render_error );
+        REQUIRE_THROWS_AS( cache.add("e", "{% include 'koura.hpp' %}"), koura::render_error );
+    }
+
+    SECTION ("files") {
+        auto dir = std::filesystem::temp_directory_path() / "koura_test_templates";
+        std::filesystem::create_directories(dir);
+        auto write = [&dir](const char* name, const char* text) {
+            std::ofstream file {dir / name};
+            file << text;
+        };
+        write("base.html", "[{% block body %}{% endblock %}]");
+        write("page.html", "{% extends 'base.html' %}{% block body %}{{title}}{% endblock %}");
+
+        koura::template_cache files{engine, dir};
+        files.render("page.html", out, ctx);
+        REQUIRE( out.str() == "[Home]" );
+        REQUIRE( files.refresh() == 0 );
+
+        write("base.html", "<{% block body %}{% endblock %}>");
+        std::filesystem::last_write_time(dir / "base.html",
+                                         std::filesystem::last_write_time(dir / "base.html") + std::chrono::seconds{10});
+        REQUIRE( files.refresh() == 1 );
+        std::stringstream again;
+        files.render("page.html", again, ctx);
+        REQUIRE( again.str() == "<Home>" );
+
+        //Names can't escape the root directory
+        write("../koura_test_outside.html", "outside");
+        auto outside = (dir / "../koura_test_outside.html").string();
+        auto loader = koura::file_loader(dir);
+        REQUIRE_THROWS_AS( engine.compile("{% include '../koura_test_outside.html' %}", loader), koura::render_error );
+        REQUIRE_THROWS_AS( engine.compile("{% include 'a/../../koura_test_outside.html' %}", loader), koura::render_error );
+        REQUIRE_THROWS_AS( engine.compile("{% include '" + outside + "' %}", loader), koura::render_error );
+        REQUIRE_THROWS_AS( files.get("../koura_test_outside.html"), koura::render_error );
+        REQUIRE_THROWS_AS( files.get(outside), koura::render_error );
+        std::stringstream inside;
+        engine.render(engine.compile("{% include './sub/../base.html' %}", loader), inside, ctx);
+        REQUIRE( inside.str() == "<>" );
+
+        std::filesystem::remove(dir / "../koura_test_outside.html");
+        std::filesystem::remove_all(dir);
+    }
+}
+
+TEST_CASE("constant folding", "[optimise]") {
+    koura::engine engine{};
+    koura::context constants{};
+    constants.add_entity("beta", koura::number_t{1});
+    constants.add_entity("site", "koura");
+
+    //Constants are left out of the render context, so only folded lookups can succeed
+    koura::context ctx{};
+    ctx.add_entity("names", koura::sequence_t{koura::text_t{"a"}, koura::text_t{"b"}});
+    auto render = [&](std::string_view text) {
+        std::stringstream out;
+        engine.render(engine.optimise(engine.compile(text), constants), out, ctx);
+        return out.str();
+    };
+
+    SECTION ("variables and filters") {
+        REQUIRE( render("<title>{{site|upper}}</title>{{site}}"sv) == "<title>KOURA</title>koura" );
+    }
+
+    SECTION ("dead branches") {
+        REQUIRE( render("{% if beta %}new{% else %}{{missing}}{% endif %}|{% unless beta %}{{missing}}{% endunless %}"sv) == "new|" );
+        REQUIRE( render("{% if beta %}{% elseif missing %}{{missing}}{% endif %}"sv) == "" );
+    }
+
+    SECTION ("set") {
+        //The `set` still runs, so custom tags and the caller see the new value
+        engine.register_custom_expression("site", [](const koura::engine&, std::istream&, std::ostream& out,
+                                                     koura::context& ctx, const std::any&) {
+            out << ctx.get_entity("site").get_value<koura::text_t>();
+        }, {});
+        koura::context full{};
+        full.add_entity("site", "koura");
+        auto tmpl = engine.optimise(engine.compile("{{site}} {% set site 'other' %}{{site}} {% site %}"sv), constants);
+        std::stringstream out;
+        engine.render(tmpl, out, full);
+        REQUIRE( out.str() == "koura other other" );
+        REQUIRE( full.get_entity("site").get_value<koura::text_t>() == "other" );
+        REQUIRE( constants.get_entity("site").get_value<koura::text_t>() == "koura" );
+    }
+
+    SECTION ("runtime values are left alone") {
+        REQUIRE( render("{% for site in names %}{{site}}{% endfor %}"sv) == "ab" );
+        REQUIRE_THROWS_AS( render("{% if names %}{% set site 'x' %}{% endif %}{{site}}"sv), std::out_of_range );
+        REQUIRE_THROWS_AS( render("{{site|nope}}"sv), std::out_of_range );
+    }
+
+    SECTION ("matches an unoptimised render") {
+        auto text = "{% for n in names %}{% if beta %}[{{n}}:{{site}}]{% else %}-{% endif %}{% endfor %}!"sv;
+        koura::context full = constants.new_scope();
+        full.add_entity("names", ctx.get_entity("names"));
+        std::stringstream expected;
+        engine.render(engine.compile(text), expected, full);
+        REQUIRE( render(text) == expected.str() );
+    }
+}
+
+namespace {
+    KOURA_STATIC_TEMPLATE(static_page,
+        "<h1>{{title|upper}}</h1>\n"
+        "{% for row in rows %}{% if row.id %}<li>{{row.name}}</li>{% else %}none{% endif %}{% endfor %}\n"
+        "{% unless missing %}{% set title 'Done' %}{{title}}{% endunless %}");
+
+    KOURA_STATIC_TEMPLATE(static_branches,
+        "{% if a %}A{% elseif b %}B{% else %}{% if c %}C{% endif %}Z{% endif %}|"
+        "{% if b %}{% if a %}x{% else %}{% endif %}{% endif %}|{% unless a %}U{% else %}-{% endunless %}|"
+        "{% for x in xs %}{% if x %}[{{x|upper}}]{% elseif a %}-{% endif %}{% endfor %}");
+
+    //Long templates must only deepen template instantiation with nesting, not with their length
+    struct long_static_source {
+        static constexpr std::string_view item = "<li>{{name}}</li>";
+        static constexpr auto storage = [] {
+            std::array<char, item.size() * 500> text {};
+            for (std::size_t i = 0; i < text.size(); ++i) {
+                text[i] = item[i % item.size()];
+            }
+            return text;
+        }();
+        static constexpr std::string_view text() { return {storage.data(), storage.size()}; }
+    };
+
+    //Malformed templates don't compile, so check the parser directly
+    constexpr bool parses (std::string_view text) {
+        return koura::detail::static_parser<0>{text}.parse().size > 0;
+    }
+    static_assert(parses("{% for x in xs %}{{x}}{% endfor %}"));
+}
+
+TEST_CASE("static templates", "[static]") {
+    koura::engine engine{};
+    koura::context ctx{};
+    ctx.add_entity("title", "Report");
+    koura::sequence_t rows;
+    for (int i = 0; i < 3; ++i) {
+        koura::object_t row;
+        row["id"] = koura::number_t{i};
+        row["name"] = koura::text_t{"row " + std::to_string(i)};
+        rows.emplace_back(std::move(row));
+    }
+    ctx.add_entity("rows", std::move(rows));
+
+    std::stringstream out;
+    static_page::render(engine, out, ctx);
+
+    std::stringstream expected;
+    koura::context ctx2 = ctx.new_scope();
+    ctx2.add_entity("title", "Report");
+    engine.render(static_page_source::text(), expected, ctx2);
+    REQUIRE( out.str() == expected.str() );
+    REQUIRE( out.str() == "<h1>REPORT</h1>\n<li>row 0</li><li>row 1</li><li>row 2</li>Done" );
+
+    SECTION ("branches") {
+        for (int flags = 0; flags < 8; ++flags) {
+            koura::context branches{};
+            branches.add_entity("a", bool(flags & 1));
+            branches.add_entity("b", bool(flags & 2));
+            branches.add_entity("c", bool(flags & 4));
+            branches.add_entity("xs", koura::sequence_t{koura::text_t{"p"}, koura::text_t{""}});
+            std::stringstream branches_out, branches_expected;
+            static_branches::render(engine, branches_out, branches);
+            engine.render(static_branches_source::text(), branches_expected, branches);
+            REQUIRE( branches_out.str() == branches_expected.str() );
+        }
+    }
+
+    SECTION ("long templates") {
+        koura::context names{};
+        names.add_entity("name", "n");
+        std::stringstream long_out;
+        koura::static_template<long_static_source>::render(engine, long_out, names);
+        REQUIRE( long_out.str().size() == 500 * "<li>n</li>"sv.size() );
+    }
+
+    SECTION ("block scope") {
+        KOURA_STATIC_TEMPLATE(greeting, "Hello {{title}}");
+        std::stringstream greeting_out;
+        greeting::render(engine, greeting_out, ctx);
+        REQUIRE( greeting_out.str() == "Hello Done" );
+    }
+
+    SECTION ("deferred entities") {
+        KOURA_STATIC_TEMPLATE(greeting, "Hello {{title}}{% if title %}!{% endif %}");
+        std::promise<koura::entity> title;
+        koura::context pending{};
+        pending.add_entity("title", koura::deferred{title.get_future()});
+        std::thread producer {[&title] {
+            std::this_thread::sleep_for(std::chrono::milliseconds{20});
+            title.set_value(koura::text_t{"Ada"});
+        }};
+        std::stringstream greeting_out;
+        greeting::render(engine, greeting_out, pending);
+        producer.join();
+        REQUIRE( greeting_out.str() == "Hello Ada!" );
+    }
+
+    SECTION ("same grammar as compiled templates") {
+        KOURA_STATIC_TEMPLATE(literals,
+            "{% set price 2.5 %}{{price}} {% set count 42 %}{{count}} {% set title 'a b' %}{{title}}"
+            "{% if 0.0 %}!{% endif %}{% unless 9223372036854775807 %}?{% endunless %}");
+        auto scope = [] {
+            koura::context values{};
+            values.add_entity("price", koura::real_t{0});
+            values.add_entity("count", koura::number_t{0});
+            values.add_entity("title", "");
+            return values;
+        };
+        koura::context static_scope = scope(), compiled_scope = scope();
+        std::stringstream literals_out;
+        literals::render(engine, literals_out, static_scope);
+
+        std::stringstream literals_expected;
+        engine.render(literals_source::text(), literals_expected, compiled_scope);
+        REQUIRE( literals_out.str() == literals_expected.str() );
+        REQUIRE( literals_out.str() == "2.5 42 a b!" );
+
+        for (auto text : {"{% for x in 3 %}{% endfor %}"sv, "{% for x in 'abc' %}{% endfor %}"sv,
+                          "{% set title 9223372036854775808 %}"sv, "{% set title 'open %}"sv}) {
+            REQUIRE_THROWS_AS( engine.compile(text), koura::render_error );
+            REQUIRE_THROWS_AS( koura::detail::static_parser<0>{text}.parse(), koura::render_error );
+        }
+    }
+}
+
+TEST_CASE("cache blocks", "[cache]") {
+    koura::engine engine{};
+    koura::context ctx{};
+    ctx.add_entity("names", koura::sequence_t{koura::text_t{"alice"}, koura::text_t{"bob"}});
+    ctx.add_entity("user", "carol");
+    ctx.add_entity("id", koura::number_t{7});
+
+    auto tmpl = engine.compile("{% cache 'nav' %}{% for name in names %}{{name}} {% endfor %}{% endcache %}"
+                               "| {% cache id ttl 60 %}{{user}}{% cache 'inner' %}!{% endcache %}{% endcache %}"sv);
+    koura::fragment_cache cache;
+    koura::render_options options;
+    options.cache = &cache;
+
+    auto render = [&](const koura::render_options& opts) {
+        std::stringstream out;
+        engine.render(tmpl, out, ctx, opts);
+        return out.str();
+    };
+
+    REQUIRE( render(options) == "alice bob | carol!" );
+    REQUIRE( cache.size() == 3 );
+
+    ctx.get_entity("names").get_value<koura::sequence_t>().pop_back();
+    ctx.get_entity("user").get_value<koura::text_t>() = "dave";
+    REQUIRE( render(options) == "alice bob | carol!" );
+    REQUIRE( render({}) == "alice | dave!" );
+
+    cache.invalidate("nav");
+    REQUIRE( render(options) == "alice | carol!" );
+
+    ctx.get_entity("id").get_value<koura::number_t>() = 8;
+    REQUIRE( render(options) == "alice | dave!" );
+
+    SECTION ("blocks with the same key") {
+        ctx.add_entity("name", "alice");
+        ctx.get_entity("id").get_value<koura::number_t>() = 7;
+        auto first = engine.compile("{% cache user %}NAV[{{name}}]{% endcache %} "
+                                    "{% cache user %}FOOT[{{name}}]{% endcache %}"sv);
+        auto second = engine.compile("{% cache user %}SIDE[{{name}}]{% endcache %}"sv);
+        auto typed = engine.compile("{% cache '7' %}text {{name}}{% endcache %}, "
+                                    "{% cache id %}number {{name}}{% endcache %}"sv);
+
+        auto render_with = [&](const koura::compiled_template& with) {
+            std::stringstream out;
+            engine.render(with, out, ctx, options);
+            return out.str();
+        };
+
+        REQUIRE( render_with(first) == "NAV[alice] FOOT[alice]" );
+        REQUIRE( render_with(second) == "SIDE[alice]" );
+        REQUIRE( render_with(typed) == "text alice, number alice" );
+        REQUIRE( render(options) == "alice | carol!" );
+
+        ctx.get_entity("name").get_value<koura::text_t>() = "bob";
+        REQUIRE( render_with(first) == "NAV[alice] FOOT[alice]" );
+        REQUIRE( render_with(second) == "SIDE[alice]" );
+
+        //Invalidating a key drops it from every block, but only for keys of the same type
+        cache.invalidate("dave");
+        cache.invalidate(koura::number_t{7});
+        REQUIRE( render_with(first) == "NAV[bob] FOOT[bob]" );
+        REQUIRE( render_with(second) == "SIDE[bob]" );
+        REQUIRE( render_with(typed) == "text alice, number bob" );
+        REQUIRE( render(options) == "alice | dave!" );
+    }
+
+    SECTION ("eviction") {
+        koura::fragment_cache small {2};
+        koura::fragment_cache::block_id block {};
+        small.store(block, koura::text_t{"a"}, "1");
+        small.store(block, koura::text_t{"b"}, "2");
+        REQUIRE( small.find(block, koura::text_t{"a"}) );
+        small.store(block, koura::text_t{"c"}, "3");
+        REQUIRE( small.size() == 2 );
+        REQUIRE( small.find(block, koura::text_t{"a"}) );
+        REQUIRE( !small.find(block, koura::text_t{"b"}) );
+        REQUIRE( *small.find(block, koura::text_t{"c"}) == "3" );
+        REQUIRE( !small.find({block.tmpl, 1}, koura::text_t{"c"}) );
+    }
+
+    SECTION ("expiry") {
+        cache.store({}, koura::text_t{"brief"}, "text", std::chrono::milliseconds{1});
+        std::this_thread::sleep_for(std::chrono::milliseconds{20});
+        REQUIRE( !cache.find({}, koura::text_t{"brief"}) );
+    }
+
+    SECTION ("huge ttl") {
+        //TTLs too long for the clock never expire, rather than overflowing
+        auto forever = engine.compile("{% cache 'k' ttl 9999999999999 %}{{user}}{% endcache %}"
+                                      "{% cache 'k' ttl 9223372036854775807 %}{{user}}{% endcache %}"sv);
+        std::stringstream first;
+        engine.render(forever, first, ctx, options);
+        ctx.get_entity("user").get_value<koura::text_t>() = "erin";
+        std::stringstream second;
+        engine.render(forever, second, ctx, options);
+        REQUIRE( first.str() == "davedave" );
+        REQUIRE( second.str() == "davedave" );
+
+        cache.store({}, koura::text_t{"long"}, "text", koura::fragment_cache::clock::duration::max());
+        REQUIRE( *cache.find({}, koura::text_t{"long"}) == "text" );
+    }
+
+    SECTION ("malformed blocks") {
+        REQUIRE_THROWS_AS( engine.compile("{% cache 'a' %}unclosed"sv), koura::render_error );
+        REQUIRE_THROWS_AS( engine.compile("{% cache 'a' for 5 %}{% endcache %}"sv), koura::render_error );
+        auto bad_key = engine.compile("{% cache names %}x{% endcache %}"sv);
+        std::stringstream out;
+        REQUIRE_THROWS_AS( engine.render(bad_key, out, ctx, options), koura::render_error );
+    }
+}
+
+TEST_CASE("live rendering", "[live]") {
+    koura::engine engine{};
+    koura::context ctx{};
+    koura::object_t stats;
+    stats["visits"] = koura::number_t{10};
+    stats["sales"] = koura::number_t{2};
+    ctx.add_entity("stats", std::move(stats));
+    ctx.add_entity("title", "Dashboard");
+    ctx.add_entity("names", koura::sequence_t{koura::text_t{"alice"}, koura::text_t{"bob"}});
+
+    auto tmpl = engine.compile("<h1>{{title}}</h1>visits {{stats.visits}}, sales {{stats.sales}}"
+                               "{% for name in names %} {{name}}{% endfor %}{% if show %} hidden {{title}}{% endif %}."sv);
+    auto live = engine.render_live(tmpl, ctx);
+    REQUIRE( live.text() == "<h1>Dashboard</h1>visits 10, sales 2 alice bob." );
+
+    SECTION ("only changed parts are re-rendered") {
+        ctx.update("title", "Sales");
+        auto changes = live.update();
+        REQUIRE( live.text() == "<h1>Sales</h1>visits 10, sales 2 alice bob." );
+        REQUIRE( changes.size() == 1 );
+        REQUIRE( changes[0].offset == 4 );
+        REQUIRE( changes[0].removed == 9 );
+        REQUIRE( changes[0].inserted == 5 );
+
+        ctx.get_entity("stats").get_value<koura::object_t>()[koura::symbol{"sales"}] = koura::number_t{300};
+        ctx.get_entity("stats").get_value<koura::object_t>()[koura::symbol{"visits"}] = koura::number_t{99};
+        ctx.mark_changed({"stats", "sales"});
+        changes = live.update();
+        REQUIRE( live.text() == "<h1>Sales</h1>visits 10, sales 300 alice bob." );
+        REQUIRE( changes.size() == 1 );
+        REQUIRE( changes[0].offset == 31 );
+
+        ctx.mark_changed({"stats"});
+        live.update();
+        REQUIRE( live.text() == "<h1>Sales</h1>visits 99, sales 300 alice bob." );
+
+        REQUIRE( live.update().empty() );
+    }
+
+    SECTION ("loops and untaken branches") {
+        ctx.update("names", koura::sequence_t{koura::text_t{"carol"}});
+        live.update();
+        REQUIRE( live.text() == "<h1>Dashboard</h1>visits 10, sales 2 carol." );
+
+        ctx.update("show", koura::number_t{1});
+        auto changes = live.update();
+        REQUIRE( live.text() == "<h1>Dashboard</h1>visits 10, sales 2 carol hidden Dashboard." );
+        REQUIRE( changes.size() == 1 );
+
+        //The branch now reads the title too
+        ctx.update("title", "Home");
+        changes = live.update();
+        REQUIRE( live.text() == "<h1>Home</h1>visits 10, sales 2 carol hidden Home." );
+        REQUIRE( changes.size() == 2 );
+        REQUIRE( changes[1].offset == 37 );
+    }
+}
+
+TEST_CASE("batch rendering", "[batch]") {
+    koura::engine engine{};
+    auto tmpl = engine.compile("Dear {{name | upper}}, you owe {{amount}}.\n"sv);
+
+    std::vector<koura::context> contexts (3);
+    const char* names[] = {"alice", "bob", "carol"};
+    for (std::size_t i = 0; i < contexts.size(); ++i) {
+        contexts[i].add_entity("name", names[i]);
+        contexts[i].add_entity("amount", koura::number_t{static_cast<int>(i * 10)});
+    }
+
+    auto batch = engine.render_batch(tmpl, contexts);
+    REQUIRE( batch.size() == 3 );
+    REQUIRE( batch[0] == "Dear ALICE, you owe 0.\n" );
+    REQUIRE( batch[2] == "Dear CAROL, you owe 20.\n" );
+    REQUIRE( batch.text() == "Dear ALICE, you owe 0.\nDear BOB, you owe 10.\nDear CAROL, you owe 20.\n" );
+    REQUIRE( batch.offsets() == std::vector<std::size_t>{0, 23, 45, 69} );
+
+    std::vector<koura::entity> name_column, amount_column;
+    for (int i = 0; i < 1000; ++i) {
+        name_column.emplace_back(koura::text_t{"customer " + std::to_string(i)});
+        amount_column.emplace_back(koura::number_t{i});
+    }
+    auto fill = [&](std::size_t row, koura::context& ctx) {
+        ctx.bind_entity("name", name_column[row]);
+        ctx.bind_entity("amount", amount_column[row]);
+    };
+
+    auto columns = engine.render_batch(tmpl, name_column.size(), fill);
+    REQUIRE( columns.size() == 1000 );
+    REQUIRE( columns[999] == "Dear CUSTOMER 999, you owe 999.\n" );
+
+    SECTION ("sharded") {
+        koura::thread_pool pool {3};
+        koura::render_options options;
+        options.pool = &pool;
+        auto sharded = engine.render_batch(tmpl, name_column.size(), fill, options);
+        REQUIRE( sharded.text() == columns.text() );
+        REQUIRE( sharded.offsets() == columns.offsets() );
+
+        auto empty = engine.render_batch(tmpl, 0, fill, options);
+        REQUIRE( empty.size() == 0 );
+        REQUIRE( empty.text().empty() );
+
+        koura::entity not_text {koura::object_t{}};
+        auto failing = [&](std::size_t row, koura::context& ctx) {
+            fill(row, ctx);
+            if (row == 500) {
+                ctx.bind_entity("amount", not_text);
+            }
+        };
+        REQUIRE_THROWS_AS( engine.render_batch(tmpl, name_column.size(), failing, options), koura::render_error );
+    }
+}
+
+TEST_CASE("numeric entities", "[numbers]") {
+    koura::engine engine{};
+    koura::context ctx{};
+    ctx.add_entity("id", std::int64_t{9'007'199'254'740'993});
+    ctx.add_entity("price", 1234.5);
+    ctx.add_entity("third", 1.0 / 3);
+    ctx.add_entity("small", -42);
+    ctx.add_entity("yes", true);
+    ctx.add_entity("no", false);
+
+    auto render = [&](std::string_view text) {
+        std::stringstream out;
+        engine.render(text, out, ctx);
+        return out.str();
+    };
+
+    REQUIRE( ctx.get_entity("id").get_type() == koura::entity::type::number );
+    REQUIRE( ctx.get_entity("price").get_type() == koura::entity::type::real );
+    REQUIRE( ctx.get_entity("yes").get_type() == koura::entity::type::boolean );
+
+    REQUIRE( render("{{id}} {{price}} {{third}} {{small}} {{yes}} {{no}}") ==
+             "9007199254740993 1234.5 0.3333333333333333 -42 true false" );
+    REQUIRE( render("{% if yes %}a{% endif %}{% if no %}b{% endif %}{% unless no %}c{% endunless %}") == "ac" );
+    ctx.add_entity("ratio", 0.0);
+    REQUIRE( render("{% set ratio 2.25 %}{{ratio}}") == "2.25" );
+
+    SECTION ("bound values") {
+        double rate = 0.125;
+        bool enabled = false;
+        unsigned long long big = 18'000'000'000ull;
+        ctx.add_entity("rate", koura::ref(rate));
+        ctx.add_entity("enabled", koura::ref(enabled));
+        ctx.add_entity("big", koura::ref(big));
+        REQUIRE( render("{{rate}} {{enabled}} {{big}}{% if enabled %}!{% endif %}") == "0.125 false 18000000000" );
+    }
+
+    SECTION ("format filters") {
+        ctx.add_entity("total", std::int64_t{1'234'567'890});
+        REQUIRE( render("{{price | fixed}}|{{third | fixed: 4}}|{{small | fixed: 0}}") == "1234.50|0.3333|-42" );
+        REQUIRE( render("{{total | thousands}}|{{small | thousands}}|{{price | fixed: 2 | thousands}}") ==
+                 "1,234,567,890|-42|1,234.50" );
+        REQUIRE( render("[{{small | pad: 6}}][{{small | zero_pad:6}}][{{id | pad: 2}}]") ==
+                 "[   -42][-00042][9007199254740993]" );
+        REQUIRE( render("{{price | fixed: 1 | upper}}") == "1234.5" );
+
+        //Numbers aren't read back from text, so they keep their precision
+        REQUIRE( render("{{id | fixed: 0}}|{{id | fixed: 1}}|{{id | thousands}}") ==
+                 "9007199254740993|9007199254740993.0|9,007,199,254,740,993" );
+        ctx.add_entity("huge", 1e22);
+        ctx.add_entity("tiny", -1.5e-7);
+        REQUIRE( render("{{huge}}|{{huge | thousands}}|{{tiny | thousands}}") ==
+                 "1e+22|10,000,000,000,000,000,000,000|-0.00000015" );
+        ctx.add_entity("digits", "9007199254740993");
+        REQUIRE( render("{{digits | fixed: 0}}|{{huge | pad: 8}}") == "9007199254740993|   1e+22" );
+
+        REQUIRE_THROWS_AS( render("{{yes | fixed}}"), koura::render_error );
+        REQUIRE_THROWS_AS( render("{{price | pad}}"), koura::render_error );
+        REQUIRE_THROWS_AS( render("{{price | upper: 2}}"), koura::render_error );
+        REQUIRE_THROWS_AS( render("{{price | pad: x}}"), koura::render_error );
+    }
+}
@@ -0,0 +1,75 @@
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+//The profiling hooks change the engine, so they're built into a test of their own
+#define KOURA_PROFILING 1
+
+#include <algorithm>
+#include <string>
+#include <sstream>
+#include "koura.hpp"
+using namespace std::string_view_literals;
+
+TEST_CASE("profiling", "[profiling]") {
+    koura::engine engine{};
+    koura::context ctx{};
+    ctx.add_entity("names", koura::sequence_t{koura::text_t{"alice"}, koura::text_t{"bob"}, koura::text_t{"carol"}});
+    engine.register_custom_expression("shout", [](const koura::engine&, std::istream&, std::ostream& out,
+                                                  koura::context&, const std::any&) {
+        out << "HEY";
+    }, {});
+
+    auto tmpl = engine.compile("<ul>\n{% for name in names %}\n<li>{{ name | upper }}</li>\n{% endfor %}</ul>{% shout %}"sv);
+    koura::profiler prof;
+    engine.set_profiler(&prof);
+    std::stringstream out;
+    engine.render(tmpl, out, ctx);
+    REQUIRE( out.str() == "<ul>\n<li>ALICE</li>\n<li>BOB</li>\n<li>CAROL</li>\n</ul>HEY" );
+
+    auto find = [](const std::vector<koura::profiler::entry>& entries, const std::string& name) {
+        auto it = std::find_if(entries.begin(), entries.end(), [&](auto&& e) { return e.name == name; });
+        REQUIRE( it != entries.end() );
+        return *it;
+    };
+
+    auto tags = prof.tags();
+    auto loop = find(tags, "line 2: {% for name in names %}");
+    auto variable = find(tags, "line 3: {{ name | upper }}");
+    REQUIRE( loop.count == 1 );
+    REQUIRE( variable.count == 3 );
+    REQUIRE( variable.bytes == 13 );
+    REQUIRE( loop.bytes == 13 + 3 * 10 );
+    REQUIRE( loop.time >= variable.time );
+    REQUIRE( find(tags, "line 4: {% shout %}").bytes == 3 );
+
+    auto handlers = prof.handlers();
+    REQUIRE( find(handlers, "filter upper").count == 3 );
+    REQUIRE( find(handlers, "filter upper").bytes == 13 );
+    REQUIRE( find(handlers, "tag shout").count == 1 );
+
+    auto lines = prof.lines();
+    REQUIRE( find(lines, "line 3").bytes == 13 + 3 * 10 );
+    REQUIRE( find(lines, "line 1").bytes == 5 );
+
+    std::stringstream folded;
+    prof.write_folded(folded);
+    bool nested = false;
+    for (std::string line; std::getline(folded, line);) {
+        auto space = line.rfind(' ');
+        REQUIRE( space != std::string::npos );
+        REQUIRE( std::stoll(line.substr(space + 1)) > 0 );
+        nested |= line.rfind("{% for name in names %} (line 2);{{ name | upper }} (line 3)", 0) == 0;
+    }
+    REQUIRE( nested );
+
+    std::stringstream report;
+    prof.write_report(report);
+    REQUIRE( report.str().find("filter upper") != std::string::npos );
+
+    SECTION ("stopping") {
+        prof.clear();
+        engine.set_profiler(nullptr);
+        engine.render(tmpl, out, ctx);
+        REQUIRE( prof.tags().empty() );
+    }
+}